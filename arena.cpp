@@ -0,0 +1,43 @@
+#include "arena.h"
+
+#include <numeric>
+
+ip::arena::arena(size_t chunk_size)
+  : chunk_size(std::max<size_t>(chunk_size, 64)), chunks(), sizes(), cursor(nullptr), limit(nullptr), allocations(0)
+{
+}
+
+void* ip::arena::grow(size_t bytes, size_t alignment)
+{
+  // chunks at least double, so a growing working set needs few of them
+  auto size = std::max(bytes + alignment, chunk_size);
+  if (!sizes.empty())
+    size = std::max(size, 2 * sizes.back());
+
+  chunks.emplace_back(new char[size]);
+  sizes.push_back(size);
+  ++allocations;
+  cursor = chunks.back().get();
+  limit = cursor + size;
+  return allocate(bytes, alignment);
+}
+
+void ip::arena::reset()
+{
+  if (chunks.size() > 1)
+  {
+    auto size = capacity();
+    chunks.clear();
+    sizes.clear();
+    chunks.emplace_back(new char[size]);
+    sizes.push_back(size);
+    ++allocations;
+  }
+  cursor = chunks.empty() ? nullptr : chunks.front().get();
+  limit = chunks.empty() ? nullptr : cursor + sizes.front();
+}
+
+size_t ip::arena::capacity() const
+{
+  return std::accumulate(std::begin(sizes), std::end(sizes), size_t(0));
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include "ip_filter.h"
+
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <new>
+
+namespace ip
+{
+
+  //! monotonic memory resource for request loops: allocation bumps a pointer,
+  //! deallocation is a no-op and reset() makes everything reusable at once
+  //!
+  //! after a reset the chunks are merged into a single one as large as all of
+  //! them, so a loop with a steady working set stops calling the heap after its
+  //! first round; one arena per thread, it is not synchronized
+  class arena
+  {
+    public:
+      explicit arena(size_t chunk_size = 64 * 1024);
+
+      arena(const arena&) = delete;
+      arena& operator=(const arena&) = delete;
+
+      void* allocate(size_t bytes, size_t alignment)
+      {
+	auto address = (reinterpret_cast<uintptr_t>(cursor) + alignment - 1) & ~(uintptr_t(alignment) - 1);
+	if (cursor && address + bytes <= reinterpret_cast<uintptr_t>(limit))
+	{
+	  cursor = reinterpret_cast<char*>(address + bytes);
+	  return reinterpret_cast<void*>(address);
+	}
+	return grow(bytes, alignment);
+      }
+
+      //! invalidates everything allocated so far
+      void reset();
+
+      //! bytes held from the heap
+      size_t capacity() const;
+
+      //! heap allocations made so far
+      size_t chunk_allocations() const
+      {
+	return allocations;
+      }
+
+    private:
+      void* grow(size_t bytes, size_t alignment);
+
+      size_t chunk_size;
+      std::vector<std::unique_ptr<char[]>> chunks;
+      std::vector<size_t> sizes;
+      char* cursor;
+      char* limit;
+      size_t allocations;
+  };
+
+  //! standard allocator drawing from an arena
+  template<typename T>
+  class arena_allocator
+  {
+    public:
+      using value_type = T;
+
+      explicit arena_allocator(arena& resource) noexcept
+	: resource(&resource)
+      {
+      }
+
+      template<typename U>
+      arena_allocator(const arena_allocator<U>& other) noexcept
+	: resource(&other.get_arena())
+      {
+      }
+
+      T* allocate(size_t n)
+      {
+	if (n > static_cast<size_t>(-1) / sizeof(T))
+	  throw std::bad_alloc();
+	return static_cast<T*>(resource->allocate(n * sizeof(T), alignof(T)));
+      }
+
+      void deallocate(T*, size_t) noexcept
+      {
+      }
+
+      arena& get_arena() const noexcept
+      {
+	return *resource;
+      }
+
+    private:
+      arena* resource;
+  };
+
+  template<typename T, typename U>
+  bool operator==(const arena_allocator<T>& lhs, const arena_allocator<U>& rhs) noexcept
+  {
+    return (&lhs.get_arena() == &rhs.get_arena());
+  }
+
+  template<typename T, typename U>
+  bool operator!=(const arena_allocator<T>& lhs, const arena_allocator<U>& rhs) noexcept
+  {
+    return !(lhs == rhs);
+  }
+
+  template<size_t Width>
+  using arena_pool = basic_pool<Width, arena_allocator<basic_addr<Width>>>;
+}
+
+namespace ipv4
+{
+  using arena_pool = ip::arena_pool<width>;
+}
+
+namespace ipv6
+{
+  using arena_pool = ip::arena_pool<width>;
+}
@@ -0,0 +1,261 @@
+#pragma once
+
+#include "ip_filter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <iostream>
+
+namespace ip
+{
+
+  //! blocked Bloom filter: every address sets all of its bits inside one
+  //! 512-bit block, so a lookup touches a single cache line
+  template<size_t Width>
+  class bloom_filter
+  {
+    public:
+      static constexpr size_t block_bits = 512;
+      static constexpr size_t block_words = block_bits / 64;
+      static constexpr size_t batch_size = 16;
+
+      //! sized by the blocked Bloom false positive rate, the classic formula
+      //! underestimates it as the load of the blocks varies
+      bloom_filter(size_t expected_size, double false_positive_rate)
+	: hashes(1), blocks(1), words()
+      {
+	if (!(false_positive_rate > 0.0 && false_positive_rate < 1.0))
+	  throw std::invalid_argument("false positive rate must be in (0, 1)");
+
+	// the classic size is a lower bound, grown until a hash count meets the rate
+	const double ln2 = std::log(2.0);
+	const auto keys = static_cast<double>(std::max<size_t>(expected_size, 1));
+	const double bits_per_key = -std::log(false_positive_rate) / (ln2 * ln2);
+	blocks = static_cast<size_t>(std::ceil(keys * bits_per_key / block_bits));
+	for (;; blocks = std::max(blocks + 1, blocks + blocks / 64))
+	{
+	  if (fits(keys / static_cast<double>(blocks), false_positive_rate))
+	    break;
+	}
+	words.assign(blocks * block_words + block_words - 1, 0);
+      }
+
+      //! copies block data to block data, the aligned start of the new
+      //! storage rarely sits at the same offset
+      bloom_filter(const bloom_filter& other)
+	: hashes(other.hashes), blocks(other.blocks), words(other.words.size(), 0)
+      {
+	std::copy(other.data(), other.data() + blocks * block_words, data());
+      }
+
+      bloom_filter& operator=(const bloom_filter& other)
+      {
+	auto copy = bloom_filter(other);
+	return (*this = std::move(copy));
+      }
+
+      //! moves keep the storage, and with it the alignment
+      bloom_filter(bloom_filter&&) = default;
+      bloom_filter& operator=(bloom_filter&&) = default;
+
+      explicit bloom_filter(const basic_pool<Width>& ip_pool, double false_positive_rate = 0.01)
+	: bloom_filter(ip_pool.size(), false_positive_rate)
+      {
+	for (const auto& addr : ip_pool)
+	  insert(addr);
+      }
+
+      void insert(const basic_addr<Width>& addr)
+      {
+	auto h = hash(addr);
+	auto block = data() + block_index(h) * block_words;
+	probe(h, [block](size_t bit) {block[bit / 64] |= uint64_t(1) << (bit % 64); return true;});
+      }
+
+      bool contains(const basic_addr<Width>& addr) const
+      {
+	auto h = hash(addr);
+	return test(block_of(h), h);
+      }
+
+      //! batched lookup: hashes and prefetches a batch of blocks before probing them
+      template<typename InputIt, typename OutputIt>
+      OutputIt contains(InputIt first, InputIt last, OutputIt out) const
+      {
+	uint64_t batch_hashes[batch_size];
+	const uint64_t* batch_blocks[batch_size];
+	while (first != last)
+	{
+	  size_t n = 0;
+	  for (; n < batch_size && first != last; ++n, ++first)
+	  {
+	    batch_hashes[n] = hash(*first);
+	    batch_blocks[n] = block_of(batch_hashes[n]);
+	    __builtin_prefetch(batch_blocks[n]);
+	  }
+	  for (size_t i = 0; i < n; ++i)
+	    *out++ = test(batch_blocks[i], batch_hashes[i]);
+	}
+	return out;
+      }
+
+      //! keeps addresses that may be present
+      basic_pool<Width> filter(const basic_pool<Width>& ip_pool) const
+      {
+	auto found = std::vector<char>(ip_pool.size());
+	contains(std::begin(ip_pool), std::end(ip_pool), std::begin(found));
+
+	auto filtered_pool = basic_pool<Width>();
+	for (size_t i = 0; i < ip_pool.size(); ++i)
+	  if (found[i])
+	    filtered_pool.push_back(ip_pool[i]);
+	return filtered_pool;
+      }
+
+      size_t size_in_bytes() const
+      {
+	return blocks * block_bits / 8;
+      }
+
+      unsigned hash_count() const
+      {
+	return hashes;
+      }
+
+      //! expected false positive rate of a block holding a Poisson distributed
+      //! number of keys with the given mean, every key setting hash_count bits
+      static double predicted_rate(double keys_per_block, unsigned hash_count)
+      {
+	const auto last = static_cast<size_t>(keys_per_block + 12 * std::sqrt(keys_per_block) + 32);
+	const double empty = 1.0 - 1.0 / block_bits; // a bit stays clear of one probe
+	double rate = 0.0;
+	for (size_t load = 0; load <= last; ++load)
+	{
+	  const auto l = static_cast<double>(load);
+	  const double weight = std::exp(l * std::log(keys_per_block) - keys_per_block - std::lgamma(l + 1.0));
+	  rate += weight * std::pow(1.0 - std::pow(empty, l * hash_count), hash_count);
+	}
+	return rate;
+      }
+
+      //! raw host byte order image, readable by load() on the same architecture
+      void save(std::ostream& stream) const
+      {
+	const uint32_t header[] = {magic, static_cast<uint32_t>(Width), hashes, version};
+	const uint64_t block_count = blocks;
+	stream.write(reinterpret_cast<const char*>(header), sizeof(header));
+	stream.write(reinterpret_cast<const char*>(&block_count), sizeof(block_count));
+	stream.write(reinterpret_cast<const char*>(data()), static_cast<std::streamsize>(size_in_bytes()));
+	if (!stream)
+	  throw std::runtime_error("bloom_filter: write failed");
+      }
+
+      static bloom_filter load(std::istream& stream)
+      {
+	uint32_t header[4] = {};
+	uint64_t block_count = 0;
+	stream.read(reinterpret_cast<char*>(header), sizeof(header));
+	stream.read(reinterpret_cast<char*>(&block_count), sizeof(block_count));
+	if (!stream || header[0] != magic || header[1] != Width || header[3] != version
+	  || header[2] < 1 || header[2] > 16 || block_count == 0)
+	  throw std::runtime_error("bloom_filter: bad header");
+
+	auto result = bloom_filter(1, 0.5);
+	result.hashes = header[2];
+	result.blocks = static_cast<size_t>(block_count);
+	result.words.assign(result.blocks * block_words + block_words - 1, 0);
+	stream.read(reinterpret_cast<char*>(result.data()), static_cast<std::streamsize>(result.size_in_bytes()));
+	if (!stream)
+	  throw std::runtime_error("bloom_filter: truncated data");
+	return result;
+      }
+
+    private:
+      static constexpr uint32_t magic = 0x46425049; // "IPBF"
+      static constexpr uint32_t version = 1; // bits from independent hash slices
+
+      // picks the hash count with the lowest rate, false if even that misses the target
+      bool fits(double keys_per_block, double false_positive_rate)
+      {
+	double best = 1.0;
+	for (unsigned k = 1; k <= 16; ++k)
+	{
+	  const auto rate = predicted_rate(keys_per_block, k);
+	  if (rate < best)
+	  {
+	    best = rate;
+	    hashes = k;
+	  }
+	}
+	return (best <= false_positive_rate);
+      }
+
+      // the storage is over-allocated by a block and the blocks start at its
+      // first cache line boundary, which depends on where it was allocated
+      const uint64_t* data() const
+      {
+	auto address = reinterpret_cast<uintptr_t>(words.data());
+	auto aligned = (address + block_bits / 8 - 1) & ~uintptr_t(block_bits / 8 - 1);
+	return words.data() + (aligned - address) / sizeof(uint64_t);
+      }
+
+      uint64_t* data()
+      {
+	return const_cast<uint64_t*>(static_cast<const bloom_filter*>(this)->data());
+      }
+
+      size_t block_index(uint64_t h) const
+      {
+	// multiply-shift range reduction instead of a modulo
+	return static_cast<size_t>((static_cast<uint128_t>(h) * blocks) >> 64);
+      }
+
+      const uint64_t* block_of(uint64_t h) const
+      {
+	return data() + block_index(h) * block_words;
+      }
+
+      // 9-bit slices of a fresh 64-bit hash every 7 probes; probes derived by
+      // double hashing land on arithmetic progressions, which collide far more
+      // often than independent bits and break the predicted rate
+      template<typename F>
+      bool probe(uint64_t h, F f) const
+      {
+	uint64_t g = 0;
+	for (unsigned i = 0; i < hashes; ++i, g >>= 9)
+	{
+	  if (i % 7 == 0)
+	    g = hash_key(h ^ (uint64_t(0x9e3779b97f4a7c15ull) * (i / 7 + 1)));
+	  if (!f(g % block_bits))
+	    return false;
+	}
+	return true;
+      }
+
+      bool test(const uint64_t* block, uint64_t h) const
+      {
+	return probe(h, [block](size_t bit) {return ((block[bit / 64] >> (bit % 64)) & 1) != 0;});
+      }
+
+      unsigned hashes;
+      size_t blocks;
+      std::vector<uint64_t> words;
+  };
+
+  template<size_t Width> constexpr size_t bloom_filter<Width>::block_bits;
+  template<size_t Width> constexpr size_t bloom_filter<Width>::block_words;
+  template<size_t Width> constexpr size_t bloom_filter<Width>::batch_size;
+  template<size_t Width> constexpr uint32_t bloom_filter<Width>::magic;
+  template<size_t Width> constexpr uint32_t bloom_filter<Width>::version;
+}
+
+namespace ipv4
+{
+  using bloom_filter = ip::bloom_filter<width>;
+}
+
+namespace ipv6
+{
+  using bloom_filter = ip::bloom_filter<width>;
+}
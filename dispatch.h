@@ -0,0 +1,39 @@
+#pragma once
+
+#include "ip_filter.h"
+
+#include <string>
+#include <vector>
+
+namespace ip
+{
+
+  //! IPv4 hot kernels, one table per instruction set; all variants produce the
+  //! same results as the scalar one
+  struct kernels
+  {
+    const char* name;
+
+    //! writes the first whitespace delimited field of every non-empty line, as try_parse<4>() reads it,
+    //! to out until n addresses are written, malformed fields are skipped; moves first past the lines
+    //! read, returns the number written
+    size_t (*read)(const char*& first, const char* last, basic_addr<4>* out, size_t n);
+
+    //! copies matching addresses to out (room for n addresses), returns their number
+    size_t (*filter_prefix)(const basic_addr<4>* in, size_t n, const prefix<4>& pfx, basic_addr<4>* out);
+    size_t (*filter_any)(const basic_addr<4>* in, size_t n, byte_t byte, basic_addr<4>* out);
+
+    //! writes one line per address, out must hold n * 16 + 16 bytes, returns the length written
+    size_t (*format)(const basic_addr<4>* in, size_t n, char* out);
+  };
+
+  //! the best variant the CPU supports, unless overridden with select_kernels()
+  const kernels& active_kernels();
+
+  //! variants the CPU supports, the scalar one first
+  std::vector<const kernels*> supported_kernels();
+
+  //! "scalar", "sse4.2", "avx2" or "avx512"; throws if unknown or not supported by the CPU
+  const kernels& find_kernels(const std::string& name);
+  void select_kernels(const std::string& name);
+}
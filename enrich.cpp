@@ -0,0 +1,237 @@
+#include "enrich.h"
+
+#include <fstream>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace
+{
+  std::string trim(const std::string& text)
+  {
+    const auto space = " \t\r\n";
+    const auto first = text.find_first_not_of(space);
+    if (first == std::string::npos)
+      return std::string();
+    return text.substr(first, text.find_last_not_of(space) - first + 1);
+  }
+
+  std::invalid_argument bad_line(size_t line_number, const std::string& message)
+  {
+    return std::invalid_argument("line " + std::to_string(line_number) + ": " + message);
+  }
+
+  // strict, as for filter expressions: "300.1.1.1" or "garbage" are errors
+  template<size_t Width>
+  ip::key_t<Width> parse_key(const std::string& text, size_t line_number)
+  {
+    auto addr = ip::basic_addr<Width>();
+    if (!ip::try_parse<Width>(text.data(), text.data() + text.size(), addr))
+      throw bad_line(line_number, "bad address '" + text + "'");
+    return ip::to_key(addr);
+  }
+}
+
+template<size_t Width>
+ip::range_table<Width>::range_table(std::istream& stream)
+  : ranges(), labels(), layout(), layout_rank()
+{
+  auto label_index = std::unordered_map<std::string, size_t>();
+  size_t line_number = 0;
+  for (std::string line; std::getline(stream, line);)
+  {
+    ++line_number;
+    const auto tab = line.find('\t');
+    const auto text = trim(line.substr(0, tab));
+    if (text.empty() || text.front() == '#')
+      continue;
+    const auto label = (tab == std::string::npos) ? std::string() : trim(line.substr(tab + 1));
+
+    auto r = range{0, 0, 0};
+    const auto dash = text.find('-');
+    const auto slash = text.find('/');
+    if (dash != std::string::npos)
+    {
+      r.first = parse_key<Width>(trim(text.substr(0, dash)), line_number);
+      r.last = parse_key<Width>(trim(text.substr(dash + 1)), line_number);
+    }
+    else if (slash != std::string::npos)
+    {
+      const auto length_text = trim(text.substr(slash + 1));
+      const bool is_number = !length_text.empty() && length_text.size() <= 3
+	&& length_text.find_first_not_of("0123456789") == std::string::npos;
+      const auto length = is_number ? std::stoul(length_text) : Width * 8 + 1;
+      if (length > Width * 8)
+	throw bad_line(line_number, "bad prefix length '" + length_text + "'");
+      const auto mask = prefix_mask<Width>(static_cast<unsigned>(length));
+      r.first = static_cast<key_t<Width>>(parse_key<Width>(trim(text.substr(0, slash)), line_number) & mask);
+      r.last = static_cast<key_t<Width>>(r.first | ~mask);
+    }
+    else
+    {
+      r.first = r.last = parse_key<Width>(text, line_number);
+    }
+    if (r.last < r.first)
+      throw bad_line(line_number, "empty range");
+
+    r.label = label_index.emplace(label, labels.size()).first->second;
+    if (r.label == labels.size())
+      labels.push_back(label);
+    ranges.push_back(r);
+  }
+
+  std::sort(std::begin(ranges), std::end(ranges), [](const range& lhs, const range& rhs) {return lhs.first < rhs.first;});
+  for (size_t i = 1; i < ranges.size(); ++i)
+  {
+    if (ranges[i].first <= ranges[i - 1].last)
+    {
+      char buf[traits<Width>::max_text];
+      auto length = format(from_key<Width>(ranges[i].first), buf);
+      throw std::invalid_argument("overlapping ranges at " + std::string(buf, length));
+    }
+  }
+
+  layout.resize(ranges.size() + 1);
+  layout_rank.resize(ranges.size() + 1);
+  fill_layout(1, 0);
+}
+
+template<size_t Width>
+size_t ip::range_table<Width>::fill_layout(size_t node, size_t rank)
+{
+  // in-order walk of the implicit tree, children of node i are 2i and 2i + 1
+  if (node >= layout.size())
+    return rank;
+  rank = fill_layout(2 * node, rank);
+  layout[node] = ranges[rank].first;
+  layout_rank[node] = rank;
+  return fill_layout(2 * node + 1, rank + 1);
+}
+
+template<size_t Width>
+size_t ip::range_table<Width>::search(key_t<Width> key) const
+{
+  // the descent ends below the first start greater than key; the trailing
+  // ones of the path are the right turns taken after it
+  const auto n = ranges.size();
+  size_t node = 1;
+  while (node <= n)
+    node = 2 * node + (layout[node] <= key);
+  node >>= __builtin_ffsll(static_cast<long long>(~node));
+
+  const auto upper = (node == 0) ? n : layout_rank[node];
+  return (upper == 0) ? n : upper - 1;
+}
+
+template<size_t Width>
+const std::string* ip::range_table<Width>::lookup(const basic_addr<Width>& addr) const
+{
+  const auto key = to_key(addr);
+  const auto index = search(key);
+  if (index == ranges.size() || ranges[index].last < key)
+    return nullptr;
+  return &labels[ranges[index].label];
+}
+
+template<size_t Width>
+void ip::range_table<Width>::lookup(const basic_addr<Width>* in, size_t n, const std::string** out) const
+{
+  const auto size = ranges.size();
+  size_t height = 0;
+  for (auto nodes = size; nodes != 0; nodes >>= 1)
+    ++height;
+
+  key_t<Width> keys[batch_size];
+  size_t nodes[batch_size];
+  for (size_t offset = 0; offset < n; offset += batch_size)
+  {
+    const auto count = std::min(batch_size, n - offset);
+    for (size_t i = 0; i < count; ++i)
+    {
+      keys[i] = to_key(in[offset + i]);
+      nodes[i] = 1;
+    }
+
+    // all searches descend together; four levels down the subtree of a
+    // node is a contiguous run of 16 slots, fetched while the others compare
+    for (size_t level = 0; level < height; ++level)
+    {
+      for (size_t i = 0; i < count; ++i)
+      {
+	if (nodes[i] > size)
+	  continue;
+	if (16 * nodes[i] <= size)
+	  __builtin_prefetch(layout.data() + 16 * nodes[i]);
+	nodes[i] = 2 * nodes[i] + (layout[nodes[i]] <= keys[i]);
+      }
+    }
+
+    for (size_t i = 0; i < count; ++i)
+    {
+      const auto node = nodes[i] >> __builtin_ffsll(static_cast<long long>(~nodes[i]));
+      const auto upper = (node == 0) ? size : layout_rank[node];
+      const auto index = (upper == 0) ? size : upper - 1;
+      out[offset + i] = (index == size || ranges[index].last < keys[i]) ? nullptr : &labels[ranges[index].label];
+    }
+  }
+}
+
+template<size_t Width>
+const std::string* ip::range_table<Width>::cursor::next(const basic_addr<Width>& addr)
+{
+  const auto key = to_key(addr);
+  if (key > previous)
+    return table.lookup(addr);
+  previous = key;
+
+  while (position > 0 && table.ranges[position - 1].first > key)
+    --position;
+  if (position == 0 || table.ranges[position - 1].last < key)
+    return nullptr;
+  return &table.labels[table.ranges[position - 1].label];
+}
+
+template<size_t Width>
+std::vector<const std::string*> ip::range_table<Width>::join(const basic_pool<Width>& ip_pool) const
+{
+  auto result = std::vector<const std::string*>(ip_pool.size());
+  if (std::is_sorted(std::begin(ip_pool), std::end(ip_pool), std::greater<basic_addr<Width>>()))
+  {
+    auto walk = cursor(*this);
+    for (size_t i = 0; i < ip_pool.size(); ++i)
+      result[i] = walk.next(ip_pool[i]);
+  }
+  else
+  {
+    lookup(ip_pool.data(), ip_pool.size(), result.data());
+  }
+  return result;
+}
+
+template<size_t Width>
+ip::range_table<Width> ip::read_range_table(const std::string& path)
+{
+  std::ifstream stream(path);
+  if (!stream.is_open())
+    throw std::runtime_error("cannot open " + path);
+  return range_table<Width>(stream);
+}
+
+template<size_t Width>
+void ip::print(std::ostream& stream, const basic_pool<Width>& ip_pool, const std::vector<const std::string*>& labels)
+{
+  for (size_t i = 0; i < ip_pool.size(); ++i)
+  {
+    print(stream, ip_pool[i]);
+    stream << '\t';
+    if (labels[i])
+      stream << *labels[i];
+    stream << '\n';
+  }
+}
+
+template class ip::range_table<4>;
+template class ip::range_table<16>;
+template ip::range_table<4> ip::read_range_table<4>(const std::string&);
+template ip::range_table<16> ip::read_range_table<16>(const std::string&);
+template void ip::print<4>(std::ostream&, const basic_pool<4>&, const std::vector<const std::string*>&);
+template void ip::print<16>(std::ostream&, const basic_pool<16>&, const std::vector<const std::string*>&);
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "ip_filter.h"
+
+#include <string>
+#include <vector>
+#include <iostream>
+
+namespace ip
+{
+
+  //! labelled, non-overlapping address ranges read from "start-end<TAB>label"
+  //! lines ("A/len" and single addresses are accepted as well)
+  //!
+  //! sorted pools are labelled by a merge join that walks the ranges in
+  //! lockstep; other batches search an Eytzinger layout of the range starts,
+  //! several addresses at a time with the next levels prefetched
+  template<size_t Width>
+  class range_table
+  {
+    public:
+      static constexpr size_t batch_size = 16;
+
+      //! throws std::invalid_argument on malformed lines and overlapping ranges
+      explicit range_table(std::istream& stream);
+
+      //! label of the range holding addr, nullptr if none
+      const std::string* lookup(const basic_addr<Width>& addr) const;
+
+      //! batched lookup of [in, in + n) into out
+      void lookup(const basic_addr<Width>* in, size_t n, const std::string** out) const;
+
+      //! labels addresses fed in the descending order of sort(), one step of
+      //! the merge join at a time; out of order addresses are looked up
+      class cursor
+      {
+	public:
+	  explicit cursor(const range_table& table)
+	    : table(table), position(table.ranges.size()), previous(static_cast<key_t<Width>>(~key_t<Width>()))
+	  {
+	  }
+
+	  const std::string* next(const basic_addr<Width>& addr);
+
+	private:
+	  const range_table& table;
+	  size_t position; //! ranges [0, position) start at or below the last address
+	  key_t<Width> previous; //! last address joined in order
+      };
+
+      //! one label per address: a merge join when the pool is sorted, batched lookups otherwise
+      std::vector<const std::string*> join(const basic_pool<Width>& ip_pool) const;
+
+      size_t size() const
+      {
+	return ranges.size();
+      }
+
+    private:
+      struct range
+      {
+	key_t<Width> first;
+	key_t<Width> last;
+	size_t label;
+      };
+
+      size_t search(key_t<Width> key) const;
+      size_t fill_layout(size_t node, size_t rank);
+
+      std::vector<range> ranges;		//! ascending
+      std::vector<std::string> labels;		//! distinct labels
+      std::vector<key_t<Width>> layout;	//! range starts in Eytzinger order, 1-based
+      std::vector<size_t> layout_rank;	//! index into ranges of every layout slot
+  };
+
+  template<size_t Width>
+  constexpr size_t range_table<Width>::batch_size;
+
+  template<size_t Width>
+  range_table<Width> read_range_table(const std::string& path);
+
+  //! "addr<TAB>label" lines, addresses outside every range get an empty label
+  template<size_t Width>
+  void print(std::ostream& stream, const basic_pool<Width>& ip_pool, const std::vector<const std::string*>& labels);
+}
+
+namespace ipv4
+{
+  using range_table = ip::range_table<width>;
+}
+
+namespace ipv6
+{
+  using range_table = ip::range_table<width>;
+}
@@ -0,0 +1,538 @@
+#include "expression.h"
+
+#include <algorithm>
+#include <cctype>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+
+namespace
+{
+  struct token
+  {
+    enum class kind {word, symbol, end};
+
+    kind type;
+    std::string text;
+    size_t position;
+  };
+
+  bool is_word_char(char sym)
+  {
+    return (std::isalnum(static_cast<unsigned char>(sym)) || sym == '.' || sym == ':');
+  }
+
+  std::vector<token> tokenize(const std::string& text)
+  {
+    static const char* const symbols[] = {"&&", "||", "!=", "&", "|", "!", "=", "(", ")", "/", "-"};
+
+    auto tokens = std::vector<token>();
+    for (size_t i = 0; i < text.size();)
+    {
+      if (std::isspace(static_cast<unsigned char>(text[i])))
+      {
+	++i;
+	continue;
+      }
+
+      if (is_word_char(text[i]))
+      {
+	auto begin = i;
+	while (i < text.size() && is_word_char(text[i]))
+	  ++i;
+	tokens.push_back({token::kind::word, text.substr(begin, i - begin), begin});
+	continue;
+      }
+
+      auto symbol = std::find_if(std::begin(symbols), std::end(symbols)
+	  , [&](const char* s) {return text.compare(i, std::char_traits<char>::length(s), s) == 0;});
+      if (symbol == std::end(symbols))
+	throw std::invalid_argument("unexpected '" + text.substr(i, 1) + "' at " + std::to_string(i));
+      tokens.push_back({token::kind::symbol, *symbol, i});
+      i += std::char_traits<char>::length(*symbol);
+    }
+    tokens.push_back({token::kind::end, "", text.size()});
+    return tokens;
+  }
+
+  unsigned to_number(const std::string& text, unsigned max)
+  {
+    if (text.empty() || text.size() > 3
+      || !std::all_of(text.begin(), text.end(), [](char sym) {return (sym >= '0' && sym <= '9');}))
+      throw std::invalid_argument("expected a number instead of '" + text + "'");
+    auto number = static_cast<unsigned>(std::stoul(text));
+    if (number > max)
+      throw std::invalid_argument(text + " is out of range 0.." + std::to_string(max));
+    return number;
+  }
+
+  template<size_t Width>
+  ip::key_t<Width> ones()
+  {
+    return static_cast<ip::key_t<Width>>(~ip::key_t<Width>());
+  }
+
+  // syntax tree, rewritten in place by the compiler
+  template<size_t Width>
+  struct node
+  {
+    enum class kind {mask, range, any, constant, conjunction, disjunction, negation};
+
+    kind type;
+    bool negate;
+    ip::key_t<Width> first;
+    ip::key_t<Width> second;
+    std::vector<node> children;
+
+    static node leaf(kind type, ip::key_t<Width> first, ip::key_t<Width> second)
+    {
+      return node{type, false, first, second, {}};
+    }
+
+    static node constant(bool value)
+    {
+      return leaf(kind::constant, value, 0);
+    }
+
+    static node branch(kind type, std::vector<node> children)
+    {
+      return node{type, false, 0, 0, std::move(children)};
+    }
+
+    bool is_constant(bool value) const
+    {
+      return (type == kind::constant && (first != 0) == value);
+    }
+  };
+
+  // parentheses and negations a condition may sit under; the parser, the
+  // rewrites and the emission all recurse once per level
+  const size_t max_nesting = 256;
+
+  template<size_t Width>
+  class parser
+  {
+    public:
+      using node_t = node<Width>;
+
+      explicit parser(const std::string& text)
+	: tokens(tokenize(text)), current(0), nesting(0)
+      {
+      }
+
+      node_t parse()
+      {
+	auto tree = parse_or();
+	if (peek().type != token::kind::end)
+	  fail("unexpected '" + peek().text + "'");
+	return tree;
+      }
+
+    private:
+      const token& peek() const
+      {
+	return tokens[current];
+      }
+
+      bool accept(std::initializer_list<const char*> alternatives)
+      {
+	for (auto alternative : alternatives)
+	{
+	  if (peek().type != token::kind::end && peek().text == alternative)
+	  {
+	    ++current;
+	    return true;
+	  }
+	}
+	return false;
+      }
+
+      void expect(const char* text)
+      {
+	if (!accept({text}))
+	  fail(std::string("expected '") + text + "'");
+      }
+
+      [[noreturn]] void fail(const std::string& message) const
+      {
+	throw std::invalid_argument(message + " at " + std::to_string(peek().position));
+      }
+
+      void descend()
+      {
+	if (++nesting > max_nesting)
+	  fail("expression is nested deeper than " + std::to_string(max_nesting) + " levels");
+      }
+
+      node_t parse_or()
+      {
+	auto children = std::vector<node_t>{parse_and()};
+	while (accept({"or", "||", "|"}))
+	  children.push_back(parse_and());
+	return (children.size() == 1) ? children.front() : node_t::branch(node_t::kind::disjunction, std::move(children));
+      }
+
+      node_t parse_and()
+      {
+	auto children = std::vector<node_t>{parse_unary()};
+	while (accept({"and", "&&", "&"}))
+	  children.push_back(parse_unary());
+	return (children.size() == 1) ? children.front() : node_t::branch(node_t::kind::conjunction, std::move(children));
+      }
+
+      node_t parse_unary()
+      {
+	if (accept({"not", "!"}))
+	{
+	  descend();
+	  auto operand = parse_unary();
+	  --nesting;
+	  return node_t::branch(node_t::kind::negation, {std::move(operand)});
+	}
+	return parse_primary();
+      }
+
+      node_t parse_primary()
+      {
+	if (accept({"("}))
+	{
+	  descend();
+	  auto tree = parse_or();
+	  expect(")");
+	  --nesting;
+	  return tree;
+	}
+
+	if (peek().type != token::kind::word)
+	  fail("expected a condition");
+	auto word = tokens[current++].text;
+
+	if (word == "all")
+	  return node_t::constant(true);
+
+	if (word == "any")
+	{
+	  expect("=");
+	  auto byte = to_number(next_word(), 0xff);
+	  return node_t::leaf(node_t::kind::any, (ones<Width>() / 0xff) * byte, 0);
+	}
+
+	if (word.size() > 1 && word[0] == 'o' && std::isdigit(static_cast<unsigned char>(word[1])))
+	{
+	  auto position = to_number(word.substr(1), Width);
+	  if (position == 0)
+	    fail("octets are numbered from 1");
+	  bool differs = accept({"!="});
+	  if (!differs)
+	    expect("=");
+	  auto byte = to_number(next_word(), 0xff);
+
+	  auto shift = 8 * (Width - position);
+	  auto leaf = node_t::leaf(node_t::kind::mask
+	      , static_cast<key_t>(key_t(0xff) << shift)
+	      , static_cast<key_t>(key_t(byte) << shift));
+	  return differs ? node_t::branch(node_t::kind::negation, {leaf}) : leaf;
+	}
+
+	if (word.find_first_of(".:") == std::string::npos)
+	  fail("unknown condition '" + word + "'");
+
+	auto first = to_address(word);
+	if (accept({"-"}))
+	{
+	  auto last = to_address(next_word());
+	  if (last < first)
+	    fail("empty range");
+	  return node_t::leaf(node_t::kind::range, first, last);
+	}
+
+	unsigned length = Width * 8;
+	if (accept({"/"}))
+	  length = to_number(next_word(), Width * 8);
+	auto mask = ip::prefix_mask<Width>(length);
+	return node_t::leaf(node_t::kind::mask, mask, static_cast<key_t>(first & mask));
+      }
+
+      using key_t = ip::key_t<Width>;
+
+      std::string next_word()
+      {
+	if (peek().type != token::kind::word)
+	  fail("expected a value");
+	return tokens[current++].text;
+      }
+
+      // parse<4>() takes anything, conditions should not
+      key_t to_address(const std::string& text)
+      {
+	auto addr = ip::basic_addr<Width>();
+	if (!ip::try_parse<Width>(text.data(), text.data() + text.size(), addr))
+	  fail("bad address '" + text + "'");
+	return ip::to_key(addr);
+      }
+
+      std::vector<token> tokens;
+      size_t current;
+      size_t nesting;
+  };
+
+  // pushes negations down to the leaves (De Morgan), flattens nested
+  // conjunctions and disjunctions and folds constants
+  template<size_t Width>
+  node<Width> normalize(node<Width> tree, bool negate)
+  {
+    using node_t = node<Width>;
+
+    switch (tree.type)
+    {
+      case node_t::kind::negation:
+	return normalize(std::move(tree.children.front()), !negate);
+
+      case node_t::kind::constant:
+	return node_t::constant((tree.first != 0) != negate);
+
+      case node_t::kind::conjunction:
+      case node_t::kind::disjunction:
+      {
+	auto type = tree.type;
+	if (negate)
+	  type = (type == node_t::kind::conjunction) ? node_t::kind::disjunction : node_t::kind::conjunction;
+	const bool absorbing = (type == node_t::kind::disjunction);
+
+	auto children = std::vector<node_t>();
+	for (auto& child : tree.children)
+	{
+	  auto normalized = normalize(std::move(child), negate);
+	  if (normalized.is_constant(absorbing))
+	    return normalized;
+	  if (normalized.is_constant(!absorbing))
+	    continue;
+	  if (normalized.type == type)
+	    std::move(normalized.children.begin(), normalized.children.end(), std::back_inserter(children));
+	  else
+	    children.push_back(std::move(normalized));
+	}
+
+	if (children.empty())
+	  return node_t::constant(!absorbing);
+	if (children.size() == 1)
+	  return std::move(children.front());
+	return node_t::branch(type, std::move(children));
+      }
+
+      default:
+	tree.negate = (tree.negate != negate);
+	return tree;
+    }
+  }
+
+  // merges the positive mask and range leaves of every conjunction
+  template<size_t Width>
+  node<Width> fuse(node<Width> tree)
+  {
+    using node_t = node<Width>;
+
+    if (tree.type == node_t::kind::disjunction)
+    {
+      for (auto& child : tree.children)
+	child = fuse(std::move(child));
+      return tree;
+    }
+    if (tree.type != node_t::kind::conjunction)
+      return tree;
+
+    auto children = std::vector<node_t>();
+    auto mask = node_t::leaf(node_t::kind::mask, 0, 0);
+    auto range = node_t::leaf(node_t::kind::range, 0, ones<Width>());
+    bool has_mask = false, has_range = false;
+
+    for (auto& child : tree.children)
+    {
+      if (child.type == node_t::kind::mask && !child.negate)
+      {
+	if ((mask.second ^ child.second) & mask.first & child.first)
+	  return node_t::constant(false);
+	mask.first |= child.first;
+	mask.second |= child.second;
+	has_mask = true;
+      }
+      else if (child.type == node_t::kind::range && !child.negate)
+      {
+	range.first = std::max(range.first, child.first);
+	range.second = std::min(range.second, child.second);
+	if (range.second < range.first)
+	  return node_t::constant(false);
+	has_range = true;
+      }
+      else
+      {
+	children.push_back(fuse(std::move(child)));
+      }
+    }
+
+    if (has_range)
+      children.insert(children.begin(), range);
+    if (has_mask)
+      children.insert(children.begin(), mask);
+    return (children.size() == 1) ? children.front() : node_t::branch(node_t::kind::conjunction, std::move(children));
+  }
+}
+
+template<size_t Width>
+ip::expression<Width>::expression(const std::string& text)
+  : source(text), program(), depth(0)
+{
+  using node_t = node<Width>;
+
+  auto tree = fuse(normalize(parser<Width>(text).parse(), false));
+
+  // every parser level holds at most a disjunction of conjunctions, each
+  // adding a slot, and the leaves take one more
+  static_assert(2 * (max_nesting + 1) + 1 <= scratch_size, "the evaluation stack must hold the deepest program");
+
+  // postfix emission; every operand occupies a slot of the evaluation stack,
+  // and the combining operation follows every child past the first, so the
+  // depth grows with the nesting and not with the number of terms
+  size_t stack = 0;
+  std::function<void(const node_t&)> emit = [&](const node_t& n)
+  {
+    switch (n.type)
+    {
+      case node_t::kind::conjunction:
+      case node_t::kind::disjunction:
+      {
+	const auto opcode = (n.type == node_t::kind::conjunction) ? operation::code::conjunction : operation::code::disjunction;
+	emit(n.children.front());
+	for (size_t child = 1; child < n.children.size(); ++child)
+	{
+	  emit(n.children[child]);
+	  program.push_back({opcode, false, 0, 0});
+	  --stack;
+	}
+	return;
+      }
+
+      case node_t::kind::mask:
+	program.push_back({operation::code::mask, n.negate, n.first, n.second});
+	break;
+      case node_t::kind::range:
+	program.push_back({operation::code::range, n.negate, n.first, n.second});
+	break;
+      case node_t::kind::any:
+	program.push_back({operation::code::any, n.negate, n.first, 0});
+	break;
+      default:
+	program.push_back({operation::code::constant, false, n.first, 0});
+	break;
+    }
+    depth = std::max(depth, ++stack);
+  };
+  emit(tree);
+}
+
+template<size_t Width>
+void ip::expression<Width>::evaluate(const basic_addr<Width>* in, size_t n, byte_t* out) const
+{
+  using key = key_t<Width>;
+  const key low_bits = ones<Width>() / 0xff;	// 0x0101...01
+  const key high_bits = static_cast<key>(low_bits << 7);
+
+  // the evaluation stack lives on the call stack; deeper programs take
+  // shorter blocks, so that no call allocates
+  key keys[block_size];
+  byte_t stack[scratch_size];
+  const auto stride = std::min(std::min(block_size, n), scratch_size / depth);
+
+  for (size_t offset = 0; offset < n; offset += stride)
+  {
+    const auto count = std::min(stride, n - offset);
+    for (size_t i = 0; i < count; ++i)
+      keys[i] = to_key(in[offset + i]);
+
+    size_t top = 0;
+    for (const auto& op : program)
+    {
+      if (op.opcode == operation::code::conjunction || op.opcode == operation::code::disjunction)
+      {
+	--top;
+	auto result = &stack[(top - 1) * stride];
+	auto operand = result + stride;
+	if (op.opcode == operation::code::conjunction)
+	  for (size_t i = 0; i < count; ++i)
+	    result[i] &= operand[i];
+	else
+	  for (size_t i = 0; i < count; ++i)
+	    result[i] |= operand[i];
+	continue;
+      }
+
+      auto result = &stack[top++ * stride];
+      const byte_t negate = op.negate ? 1 : 0;
+      switch (op.opcode)
+      {
+	case operation::code::mask:
+	  for (size_t i = 0; i < count; ++i)
+	    result[i] = static_cast<byte_t>(((keys[i] & op.first) == op.second) ^ negate);
+	  break;
+
+	case operation::code::range:
+	  for (size_t i = 0; i < count; ++i)
+	    result[i] = static_cast<byte_t>(((keys[i] >= op.first) & (keys[i] <= op.second)) ^ negate);
+	  break;
+
+	case operation::code::any:
+	  for (size_t i = 0; i < count; ++i)
+	  {
+	    auto diff = static_cast<key>(keys[i] ^ op.first); // zero byte where the address matches
+	    result[i] = static_cast<byte_t>((((diff - low_bits) & ~diff & high_bits) != 0) ^ negate);
+	  }
+	  break;
+
+	default:
+	  std::fill(result, result + count, static_cast<byte_t>(op.first != 0));
+	  break;
+      }
+    }
+
+    std::copy(stack, stack + count, out + offset);
+  }
+}
+
+template<size_t Width>
+bool ip::expression<Width>::match(const basic_addr<Width>& addr) const
+{
+  byte_t result = 0;
+  evaluate(&addr, 1, &result);
+  return (result != 0);
+}
+
+template<size_t Width>
+bool ip::expression<Width>::as_mask(key_t<Width>& mask, key_t<Width>& value) const
+{
+  if (program.size() != 1)
+    return false;
+
+  const auto& op = program.front();
+  if (op.opcode == operation::code::constant && op.first != 0)
+  {
+    mask = value = 0;
+    return true;
+  }
+  if (op.opcode != operation::code::mask || op.negate)
+    return false;
+  mask = op.first;
+  value = op.second;
+  return true;
+}
+
+template<size_t Width>
+bool ip::expression<Width>::as_any(byte_t& byte) const
+{
+  if (program.size() != 1 || program.front().opcode != operation::code::any || program.front().negate)
+    return false;
+  byte = static_cast<byte_t>(program.front().first);
+  return true;
+}
+
+template class ip::expression<4>;
+template class ip::expression<16>;
@@ -0,0 +1,124 @@
+#pragma once
+
+#include "ip_filter.h"
+
+#include <string>
+#include <vector>
+
+namespace ip
+{
+
+  //! compiled filter expression, e.g. "o1=46 and any=70 and not 46.70.0.0/16"
+  //!
+  //!   oN=V, oN!=V     N-th octet (1-based) equals / differs from V
+  //!   any=V           any octet equals V
+  //!   A, A/len        address, CIDR block
+  //!   A-B             inclusive address range
+  //!   all             every address
+  //!   not X, X and Y, X or Y, (X)   also !, &&, ||
+  //!
+  //! negations are pushed down to the leaves, and the octet, address and
+  //! CIDR tests of a conjunction are fused into a single mask/compare, as are
+  //! its ranges; the remaining postfix program is evaluated one operation at a
+  //! time over blocks of addresses, without per-address branches
+  template<size_t Width>
+  class expression
+  {
+    public:
+      static constexpr size_t block_size = 1024;
+
+      //! throws std::invalid_argument on syntax errors and on parentheses or
+      //! negations nested more than 256 levels deep
+      explicit expression(const std::string& text);
+
+      //! writes 1 for every matching address of [in, in + n) to out, 0 otherwise;
+      //! allocation free, the evaluation stack is a fixed buffer on the call stack
+      void evaluate(const basic_addr<Width>* in, size_t n, byte_t* out) const;
+
+      bool match(const basic_addr<Width>& addr) const;
+
+      //! the matches, in a pool of the same allocator
+      template<typename Allocator>
+      basic_pool<Width, Allocator> filter(const basic_pool<Width, Allocator>& ip_pool) const
+      {
+	auto filtered_pool = basic_pool<Width, Allocator>(ip_pool.get_allocator());
+	byte_t matches[block_size];
+	for (size_t offset = 0; offset < ip_pool.size(); offset += block_size)
+	{
+	  const auto n = std::min(block_size, ip_pool.size() - offset);
+	  evaluate(ip_pool.data() + offset, n, matches);
+	  for (size_t i = 0; i < n; ++i)
+	    if (matches[i])
+	      filtered_pool.push_back(ip_pool[offset + i]);
+	}
+	return filtered_pool;
+      }
+
+      //! number of matches, without materializing them
+      template<typename Allocator>
+      size_t count(const basic_pool<Width, Allocator>& ip_pool) const
+      {
+	size_t result = 0;
+	byte_t matches[block_size];
+	for (size_t offset = 0; offset < ip_pool.size(); offset += block_size)
+	{
+	  const auto n = std::min(block_size, ip_pool.size() - offset);
+	  evaluate(ip_pool.data() + offset, n, matches);
+	  result += static_cast<size_t>(std::count(matches, matches + n, byte_t(1)));
+	}
+	return result;
+      }
+
+      //! mask and value when the whole program is one "key & mask == value"
+      //! test, e.g. "o1=46 and o2=70"; "all" gives an empty mask
+      bool as_mask(key_t<Width>& mask, key_t<Width>& value) const;
+
+      //! the byte when the whole program is "any=V"
+      bool as_any(byte_t& byte) const;
+
+      //! number of operations in the compiled program
+      size_t size() const
+      {
+	return program.size();
+      }
+
+      const std::string& text() const
+      {
+	return source;
+      }
+
+    private:
+      struct operation
+      {
+	enum class code {mask, range, any, constant, conjunction, disjunction};
+
+	code opcode;
+	bool negate;		//! leaves only
+	key_t<Width> first;	//! mask, lower bound or the byte pattern
+	key_t<Width> second;	//! value or upper bound
+      };
+
+      //! bytes of the evaluation stack, a slot of block_size while depth allows
+      static constexpr size_t scratch_size = 8 * block_size;
+
+      std::string source;
+      std::vector<operation> program;
+      size_t depth;
+  };
+
+  template<size_t Width>
+  constexpr size_t expression<Width>::block_size;
+
+  template<size_t Width>
+  constexpr size_t expression<Width>::scratch_size;
+}
+
+namespace ipv4
+{
+  using expression = ip::expression<width>;
+}
+
+namespace ipv6
+{
+  using expression = ip::expression<width>;
+}
@@ -0,0 +1,128 @@
+#include "histogram.h"
+#include "ingest.h"
+
+#include <stdexcept>
+
+template<size_t Width>
+ip::histogram<Width>::histogram()
+  : leading(buckets, 0), cumulative(buckets + 1, 0), octets(), contained()
+{
+}
+
+template<size_t Width>
+void ip::histogram<Width>::add(const basic_addr<Width>* in, size_t n)
+{
+  for (size_t i = 0; i < n; ++i)
+  {
+    const auto& addr = in[i];
+    ++leading[static_cast<size_t>(addr[0]) << 8 | addr[1]];
+    for (size_t position = 0; position < Width; ++position)
+    {
+      const auto byte = addr[position];
+      ++octets[position][byte];
+      // once per address, however often the byte repeats
+      if (static_cast<size_t>(std::find(addr.begin(), addr.end(), byte) - addr.begin()) == position)
+	++contained[byte];
+    }
+  }
+
+  for (size_t bucket = 0; bucket < buckets; ++bucket)
+    cumulative[bucket + 1] = cumulative[bucket] + leading[bucket];
+}
+
+template<size_t Width>
+void ip::histogram<Width>::merge(const histogram& other)
+{
+  for (size_t bucket = 0; bucket < buckets; ++bucket)
+  {
+    leading[bucket] += other.leading[bucket];
+    cumulative[bucket + 1] = cumulative[bucket] + leading[bucket];
+  }
+  for (size_t position = 0; position < Width; ++position)
+    for (size_t byte = 0; byte < 256; ++byte)
+      octets[position][byte] += other.octets[position][byte];
+  for (size_t byte = 0; byte < 256; ++byte)
+    contained[byte] += other.contained[byte];
+}
+
+template<size_t Width>
+size_t ip::histogram<Width>::count_prefix(key_t<Width> value, unsigned length) const
+{
+  if (length > 16)
+    throw std::invalid_argument("histogram prefixes are at most 16 bits long");
+
+  const auto span = size_t(1) << (16 - length);
+  const auto first = static_cast<size_t>(value >> (Width * 8 - 16)) & ~(span - 1);
+  return cumulative[first + span] - cumulative[first];
+}
+
+template<size_t Width>
+size_t ip::histogram<Width>::count_octet(size_t position, int byte) const
+{
+  if (position >= Width || byte < 0 || byte > 0xff)
+    return 0;
+  return octets[position][static_cast<size_t>(byte)];
+}
+
+template<size_t Width>
+size_t ip::histogram<Width>::count_any(int byte) const
+{
+  if (byte < 0 || byte > 0xff)
+    return 0;
+  return contained[static_cast<size_t>(byte)];
+}
+
+template<size_t Width>
+bool ip::histogram<Width>::try_count(key_t<Width> mask, key_t<Width> value, size_t& result) const
+{
+  if ((value & static_cast<key_t<Width>>(~mask)) != 0)
+  {
+    result = 0;
+    return true;
+  }
+
+  unsigned length = 0;
+  while (length < Width * 8 && (mask & prefix_mask<Width>(length + 1)) == prefix_mask<Width>(length + 1))
+    ++length;
+  if (mask == prefix_mask<Width>(length) && length <= 16)
+  {
+    result = count_prefix(value, length);
+    return true;
+  }
+
+  for (size_t position = 0; position < Width; ++position)
+  {
+    const auto shift = 8 * (Width - 1 - position);
+    if (mask == static_cast<key_t<Width>>(key_t<Width>(0xff) << shift))
+    {
+      result = count_octet(position, static_cast<int>((value >> shift) & 0xff));
+      return true;
+    }
+  }
+  return false;
+}
+
+template<size_t Width>
+ip::histogram<Width> ip::histogram_files(
+    const std::vector<std::string>& paths
+    , std::vector<basic_pool<Width>>& runs
+    , size_t threads
+    )
+{
+  runs.assign(paths.size(), basic_pool<Width>());
+  auto counts = std::vector<histogram<Width>>(file_workers(paths.size(), threads));
+  for_each_file(paths, threads, [&](size_t worker, size_t file)
+      {
+	runs[file] = read_file<Width>(paths[file]);
+	counts[worker].add(runs[file]);
+      });
+
+  for (size_t i = 1; i < counts.size(); ++i)
+    counts.front().merge(counts[i]);
+  return counts.front();
+}
+
+template class ip::histogram<4>;
+template class ip::histogram<16>;
+template ip::histogram<4> ip::histogram_files<4>(const std::vector<std::string>&, std::vector<basic_pool<4>>&, size_t);
+template ip::histogram<16> ip::histogram_files<16>(const std::vector<std::string>&, std::vector<basic_pool<16>>&, size_t);
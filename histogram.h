@@ -0,0 +1,135 @@
+#pragma once
+
+#include "ip_filter.h"
+
+#include <array>
+#include <string>
+#include <vector>
+
+namespace ip
+{
+
+  //! address counts by leading 16 bits with prefix sums, by octet position and
+  //! by contained byte; answers count-only queries without the pool
+  //!
+  //! prefixes of up to 16 bits take two lookups, single octets and "any" one;
+  //! a separate histogram of the distinct bytes of every address serves
+  //! count_any(), as the positional ones count an address once per repeat
+  template<size_t Width>
+  class histogram
+  {
+    public:
+      histogram();
+
+      template<typename Allocator>
+      explicit histogram(const basic_pool<Width, Allocator>& ip_pool)
+	: histogram()
+      {
+	add(ip_pool.data(), ip_pool.size());
+      }
+
+      //! counts a batch, the prefix sums are refreshed once per call
+      void add(const basic_addr<Width>* in, size_t n);
+
+      template<typename Allocator>
+      void add(const basic_pool<Width, Allocator>& ip_pool)
+      {
+	add(ip_pool.data(), ip_pool.size());
+      }
+
+      void merge(const histogram& other);
+
+      size_t size() const
+      {
+	return cumulative.back();
+      }
+
+      //! same leading bytes as filter(), at most two of them
+      template<typename... Args>
+      size_t count(Args... args) const
+      {
+	static_assert(sizeof...(args) <= 2, "the histogram resolves 16 leading bits");
+	auto pfx = make_prefix<Width>(args...);
+	size_t result = 0;
+	try_count(to_key(pfx.mask), to_key(pfx.value), result);
+	return result;
+      }
+
+      //! addresses within value/length; throws std::invalid_argument beyond 16 bits
+      size_t count_prefix(key_t<Width> value, unsigned length) const;
+
+      //! addresses whose byte at 0-based position equals byte
+      size_t count_octet(size_t position, int byte) const;
+
+      //! addresses holding byte anywhere, as filter_any()
+      size_t count_any(int byte) const;
+
+      //! answers "key & mask == value" when the mask is up to 16 leading bits
+      //! or a single whole byte, returns false otherwise
+      bool try_count(key_t<Width> mask, key_t<Width> value, size_t& result) const;
+
+    private:
+      static constexpr size_t buckets = 1 << 16;
+
+      std::vector<size_t> leading;	//! by the first two bytes
+      std::vector<size_t> cumulative;	//! cumulative[i] is the sum of leading[0, i)
+      std::array<std::array<size_t, 256>, Width> octets;
+      std::array<size_t, 256> contained;
+  };
+
+  template<size_t Width>
+  constexpr size_t histogram<Width>::buckets;
+
+  //! reads every file on a pool of worker threads into one unsorted run per
+  //! file, counted by a histogram per worker that are merged at the end;
+  //! counting needs no order, so nothing is sorted
+  template<size_t Width>
+  histogram<Width> histogram_files(
+      const std::vector<std::string>& paths
+      , std::vector<basic_pool<Width>>& runs
+      , size_t threads = 0
+      );
+
+  //! counts of the matches of filter_prefix(), filter() and filter_any(),
+  //! without materializing them
+  template<size_t Width, typename Allocator>
+  size_t count_prefix(const basic_pool<Width, Allocator>& ip_pool, const prefix<Width>& pfx)
+  {
+    const size_t chunk = 1024;
+    basic_addr<Width> matches[chunk];
+    size_t count = 0;
+    for (size_t offset = 0; offset < ip_pool.size(); offset += chunk)
+      count += filter_prefix<Width>(ip_pool.data() + offset, std::min(chunk, ip_pool.size() - offset), pfx, matches);
+    return count;
+  }
+
+  template<size_t Width, typename Allocator, typename... Args>
+  size_t count(const basic_pool<Width, Allocator>& ip_pool, Args... args)
+  {
+    return count_prefix(ip_pool, make_prefix<Width>(args...));
+  }
+
+  template<size_t Width, typename Allocator>
+  size_t count_any(const basic_pool<Width, Allocator>& ip_pool, int byte)
+  {
+    if (byte < 0 || byte > 0xff)
+      return 0;
+
+    const size_t chunk = 1024;
+    basic_addr<Width> matches[chunk];
+    size_t count = 0;
+    for (size_t offset = 0; offset < ip_pool.size(); offset += chunk)
+      count += filter_any<Width>(ip_pool.data() + offset, std::min(chunk, ip_pool.size() - offset), static_cast<byte_t>(byte), matches);
+    return count;
+  }
+}
+
+namespace ipv4
+{
+  using histogram = ip::histogram<width>;
+}
+
+namespace ipv6
+{
+  using histogram = ip::histogram<width>;
+}
@@ -0,0 +1,178 @@
+#include "ingest.h"
+#include "dispatch.h"
+#include "text.h"
+
+#include <atomic>
+#include <thread>
+#include <exception>
+#include <stdexcept>
+#include <fstream>
+
+#include <glob.h>
+
+namespace
+{
+  bool is_pattern(const std::string& path)
+  {
+    return (path.find_first_of("*?[") != std::string::npos);
+  }
+}
+
+template<size_t Width>
+size_t ip::read(const char*& first, const char* last, basic_addr<Width>* out, size_t n)
+{
+  size_t count = 0;
+  while (first != last && count < n)
+  {
+    auto eol = std::find(first, last, '\n');
+    auto field = std::find_if_not(first, eol, is_space);
+    auto field_end = std::find_if(field, eol, is_space);
+    if (field != field_end && try_parse<Width>(field, field_end, out[count]))
+      ++count;
+    first = (eol == last) ? last : eol + 1;
+  }
+  return count;
+}
+
+template<>
+size_t ip::read<4>(const char*& first, const char* last, basic_addr<4>* out, size_t n)
+{
+  return active_kernels().read(first, last, out, n);
+}
+
+template<size_t Width>
+ip::basic_pool<Width> ip::read(std::istream& stream)
+{
+  // a chunk at a time, so pipes and FIFOs work and the text is never held
+  // whole; the incomplete last line of a chunk moves to the front of the next
+  const size_t chunk = 1 << 20;
+  auto buffer = std::string();
+  auto ip_pool = basic_pool<Width>();
+  size_t pending = 0;
+  for (bool done = false; !done;)
+  {
+    buffer.resize(pending + chunk);
+    stream.read(&buffer[pending], static_cast<std::streamsize>(chunk));
+    const auto size = pending + static_cast<size_t>(stream.gcount());
+    done = !stream;
+
+    const char* first = buffer.data();
+    const char* last = buffer.data() + size;
+    if (!done)
+    {
+      const auto eol = buffer.rfind('\n', size - 1);
+      last = (eol == std::string::npos) ? first : buffer.data() + eol + 1;
+    }
+    read<Width>(first, last, ip_pool);
+
+    pending = static_cast<size_t>(buffer.data() + size - last);
+    std::copy(last, last + pending, &buffer[0]);
+  }
+  if (stream.bad())
+    throw std::runtime_error("cannot read the input");
+  return ip_pool;
+}
+
+template<size_t Width>
+ip::basic_pool<Width> ip::read_file(const std::string& path)
+{
+  std::ifstream stream(path, std::ios::binary);
+  if (!stream.is_open())
+    throw std::runtime_error("cannot open " + path);
+
+  try
+  {
+    return read<Width>(stream);
+  }
+  catch (const std::runtime_error&)
+  {
+    throw std::runtime_error("cannot read " + path);
+  }
+}
+
+std::vector<std::string> ip::expand_paths(const std::vector<std::string>& patterns)
+{
+  auto paths = std::vector<std::string>();
+  for (const auto& pattern : patterns)
+  {
+    if (!is_pattern(pattern))
+    {
+      paths.push_back(pattern);
+      continue;
+    }
+
+    glob_t matches;
+    auto status = ::glob(pattern.c_str(), 0, nullptr, &matches);
+    if (status == 0)
+      paths.insert(paths.end(), matches.gl_pathv, matches.gl_pathv + matches.gl_pathc);
+    ::globfree(&matches);
+    if (status == GLOB_NOMATCH)
+      throw std::runtime_error("no files match " + pattern);
+    if (status != 0)
+      throw std::runtime_error("cannot expand " + pattern);
+  }
+  return paths;
+}
+
+size_t ip::file_workers(size_t files, size_t threads)
+{
+  if (threads == 0)
+    threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+  return std::max<size_t>(std::min(threads, files), 1);
+}
+
+void ip::for_each_file(
+    const std::vector<std::string>& paths
+    , size_t threads
+    , const std::function<void(size_t worker, size_t file)>& fn
+    )
+{
+  auto errors = std::vector<std::exception_ptr>(paths.size());
+  std::atomic<size_t> next(0);
+
+  auto worker = [&](size_t id)
+  {
+    for (size_t i; (i = next++) < paths.size();)
+    {
+      try
+      {
+	fn(id, i);
+      }
+      catch (...)
+      {
+	errors[i] = std::current_exception();
+      }
+    }
+  };
+
+  auto workers = std::vector<std::thread>();
+  for (size_t id = 1; id < file_workers(paths.size(), threads); ++id)
+    workers.emplace_back(worker, id);
+  worker(0);
+  for (auto& thread : workers)
+    thread.join();
+
+  for (const auto& error : errors)
+    if (error)
+      std::rethrow_exception(error);
+}
+
+template<size_t Width>
+std::vector<ip::basic_pool<Width>> ip::read_sorted(const std::vector<std::string>& paths, size_t threads)
+{
+  auto runs = std::vector<basic_pool<Width>>(paths.size());
+  for_each_file(paths, threads, [&](size_t, size_t file)
+      {
+	runs[file] = read_file<Width>(paths[file]);
+	sort(runs[file]);
+      });
+  return runs;
+}
+
+template size_t ip::read<16>(const char*&, const char*, basic_addr<16>*, size_t);
+template ip::basic_pool<4> ip::read<4>(std::istream&);
+template ip::basic_pool<16> ip::read<16>(std::istream&);
+template ip::basic_pool<4> ip::read_file<4>(const std::string&);
+template ip::basic_pool<16> ip::read_file<16>(const std::string&);
+template std::vector<ip::basic_pool<4>> ip::read_sorted<4>(const std::vector<std::string>&, size_t);
+template std::vector<ip::basic_pool<16>> ip::read_sorted<16>(const std::vector<std::string>&, size_t);
@@ -0,0 +1,157 @@
+#pragma once
+
+#include "ip_filter.h"
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <functional>
+
+namespace ip
+{
+
+  //! parses the first whitespace delimited field of every non-empty line in
+  //! [first, last) to out until n addresses are written; first is moved past
+  //! the lines read, returns the number written
+  //!
+  //! malformed fields, as try_parse() tells them, are skipped in both families
+  template<size_t Width>
+  size_t read(const char*& first, const char* last, basic_addr<Width>* out, size_t n);
+
+  //! runs the active IPv4 kernel, see dispatch.h
+  template<> size_t read<4>(const char*& first, const char* last, basic_addr<4>* out, size_t n);
+
+  //! appends the addresses of [first, last) to ip_pool a chunk at a time
+  template<size_t Width, typename Allocator>
+  void read(const char* first, const char* last, basic_pool<Width, Allocator>& ip_pool)
+  {
+    const size_t chunk = 1024;
+    basic_addr<Width> addresses[chunk];
+    while (first != last)
+    {
+      auto count = read<Width>(first, last, addresses, chunk);
+      ip_pool.insert(ip_pool.end(), addresses, addresses + count);
+    }
+  }
+
+  //! reads a chunk at a time, so unseekable streams (pipes, FIFOs) work
+  template<size_t Width>
+  basic_pool<Width> read(std::istream& stream);
+
+  //! throws std::runtime_error when the file cannot be opened or read
+  template<size_t Width>
+  basic_pool<Width> read_file(const std::string& path);
+
+  //! expands glob patterns, plain paths are kept as they are
+  std::vector<std::string> expand_paths(const std::vector<std::string>& patterns);
+
+  //! worker threads for_each_file() runs on: hardware concurrency when
+  //! threads is 0, never more than files nor less than one
+  size_t file_workers(size_t files, size_t threads = 0);
+
+  //! calls fn(worker, file) once for every index of paths on a pool of
+  //! file_workers() threads, worker being the 0-based thread; the exception
+  //! of the first failed file, in path order, is rethrown once all are done
+  void for_each_file(
+      const std::vector<std::string>& paths
+      , size_t threads
+      , const std::function<void(size_t worker, size_t file)>& fn
+      );
+
+  //! reads and sorts every file on a pool of worker threads, one sorted run per file
+  template<size_t Width>
+  std::vector<basic_pool<Width>> read_sorted(const std::vector<std::string>& paths, size_t threads = 0);
+
+  //! tournament tree over descending sorted runs, top() is the greatest remaining address
+  template<size_t Width>
+  class loser_tree
+  {
+    public:
+      explicit loser_tree(const std::vector<basic_pool<Width>>& runs)
+	: runs(runs), cursors(runs.size(), 0), tree(std::max<size_t>(runs.size(), 1), none)
+      {
+	for (size_t run = 0; run < runs.size(); ++run)
+	  replay(run);
+      }
+
+      bool empty() const
+      {
+	return (runs.empty() || exhausted(tree[0]));
+      }
+
+      const basic_addr<Width>& top() const
+      {
+	return runs[tree[0]][cursors[tree[0]]];
+      }
+
+      void pop()
+      {
+	++cursors[tree[0]];
+	replay(tree[0]);
+      }
+
+    private:
+      static constexpr size_t none = static_cast<size_t>(-1);
+
+      bool exhausted(size_t run) const
+      {
+	return (cursors[run] == runs[run].size());
+      }
+
+      bool beats(size_t lhs, size_t rhs) const
+      {
+	if (exhausted(lhs))
+	  return false;
+	if (exhausted(rhs))
+	  return true;
+	const auto& lhs_addr = runs[lhs][cursors[lhs]];
+	const auto& rhs_addr = runs[rhs][cursors[rhs]];
+	return (lhs_addr > rhs_addr || (lhs_addr == rhs_addr && lhs < rhs));
+      }
+
+      // leaves are at k..2k-1, every inner node keeps the loser of its match;
+      // while building, the first run to reach a node just waits there
+      void replay(size_t run)
+      {
+	auto winner = run;
+	for (auto node = (run + runs.size()) / 2; node > 0; node /= 2)
+	{
+	  if (tree[node] == none)
+	  {
+	    tree[node] = winner;
+	    return;
+	  }
+	  if (beats(tree[node], winner))
+	    std::swap(tree[node], winner);
+	}
+	tree[0] = winner;
+      }
+
+      const std::vector<basic_pool<Width>>& runs;
+      std::vector<size_t> cursors;
+      std::vector<size_t> tree;
+  };
+
+  template<size_t Width>
+  constexpr size_t loser_tree<Width>::none;
+
+  //! feeds the merged descending order of sorted runs to sink
+  template<size_t Width, typename Sink>
+  void merge(const std::vector<basic_pool<Width>>& runs, Sink sink)
+  {
+    for (auto tree = loser_tree<Width>(runs); !tree.empty(); tree.pop())
+      sink(tree.top());
+  }
+
+  template<size_t Width>
+  basic_pool<Width> merge(const std::vector<basic_pool<Width>>& runs)
+  {
+    auto ip_pool = basic_pool<Width>();
+    size_t size = 0;
+    for (const auto& run : runs)
+      size += run.size();
+    ip_pool.reserve(size);
+    merge(runs, [&ip_pool](const basic_addr<Width>& addr) {ip_pool.push_back(addr);});
+    return ip_pool;
+  }
+}
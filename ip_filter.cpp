@@ -1,79 +1,339 @@
 #include "ip_filter.h"
+#include "dispatch.h"
 
 #include <algorithm>
 #include <numeric>
 #include <limits>
+#include <stdexcept>
+#include <cerrno>
+#include <cstdlib>
 
-void ipv4::print(std::ostream& stream, const addr_t& ip_addr)
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
+namespace
 {
-  for (auto ip_byte_it = ip_addr.cbegin(); ip_byte_it != ip_addr.cend(); ++ip_byte_it)
+  char* format_byte(char* out, ip::byte_t byte)
+  {
+    if (byte >= 100)
+    {
+      *out++ = static_cast<char>('0' + byte / 100);
+      byte %= 100;
+      *out++ = static_cast<char>('0' + byte / 10);
+    }
+    else if (byte >= 10)
+    {
+      *out++ = static_cast<char>('0' + byte / 10);
+    }
+    *out++ = static_cast<char>('0' + byte % 10);
+    return out;
+  }
+
+  char* format_hextet(char* out, unsigned hextet)
   {
-    if (ip_byte_it != ip_addr.cbegin())
-      stream << '.';
-    stream << std::to_string(*ip_byte_it);
+    static const char digits[] = "0123456789abcdef";
+    bool leading = true;
+    for (int shift = 12; shift >= 0; shift -= 4)
+    {
+      auto digit = (hextet >> shift) & 0xf;
+      if (leading && digit == 0 && shift != 0)
+	continue;
+      leading = false;
+      *out++ = digits[digit];
+    }
+    return out;
+  }
+
+  int hex_value(char sym)
+  {
+    if (sym >= '0' && sym <= '9')
+      return sym - '0';
+    if (sym >= 'a' && sym <= 'f')
+      return sym - 'a' + 10;
+    if (sym >= 'A' && sym <= 'F')
+      return sym - 'A' + 10;
+    return -1;
   }
 }
 
-void ipv4::print(std::ostream& stream, const pool_t& ip_pool)
+template<>
+ip::basic_addr<4> ip::parse<4>(const char* first, const char* last)
 {
-  for (const auto& ip_addr : ip_pool)
+  auto addr = basic_addr<4>();
+  size_t i = 0;
+  for (; first != last; ++first)
   {
-    print(stream, ip_addr);
-    stream << '\n';
+    if (*first == '.')
+    {
+      if (++i == addr.size())
+	break;
+    }
+    else
+    {
+      addr[i] = static_cast<byte_t>(addr[i] * 10);
+      addr[i] = static_cast<byte_t>(addr[i] + static_cast<byte_t>(*first) - 48); // ASCII offset of '0'
+    }
   }
+  return addr;
 }
 
-void ipv4::sort(pool_t& ip_pool)
+template<>
+bool ip::try_parse<4>(const char* first, const char* last, basic_addr<4>& addr)
 {
-  std::sort(
-    std::begin(ip_pool)
-    , std::end(ip_pool)
-    , std::greater<addr_t>()
-    );
+  for (size_t i = 0; i < addr.size(); ++i)
+  {
+    unsigned value = 0;
+    size_t digits = 0;
+    for (; first != last && *first >= '0' && *first <= '9'; ++first, ++digits)
+      value = value * 10 + static_cast<unsigned>(*first - '0');
+    if (digits == 0 || digits > 3 || value > 0xff)
+      return false;
+    addr[i] = static_cast<byte_t>(value);
+    if (i != addr.size() - 1)
+    {
+      if (first == last || *first != '.')
+	return false;
+      ++first;
+    }
+  }
+  return (first == last);
 }
 
-ipv4::pool_t ipv4::filter_any(const pool_t& ip_pool, int byte)
+template<>
+bool ip::try_parse<16>(const char* first, const char* last, basic_addr<16>& addr)
 {
-  auto filtered_pool = pool_t();
+  std::array<unsigned, 8> groups{};
+  size_t count = 0;
+  const auto no_gap = std::numeric_limits<size_t>::max();
+  auto gap = no_gap; // position of "::", if any
 
-  std::copy_if(
-      std::begin(ip_pool)
-      , std::end(ip_pool)
-      , std::back_inserter(filtered_pool)
-      , [byte](const addr_t& addr)
-	{
-	  return std::any_of(
-	      addr.cbegin()
-	      , addr.cend()
-	      , [byte](const byte_t& addr_byte)
-		{
-		  return (addr_byte == byte);
-		}
-	      );
-	}
-      );
+  auto it = first;
+  if (it != last && *it == ':')
+  {
+    if (last - it < 2 || it[1] != ':')
+      return false;
+    gap = 0;
+    it += 2;
+  }
 
-  return filtered_pool;
+  while (it != last)
+  {
+    auto group_begin = it;
+    unsigned value = 0;
+    size_t digits = 0;
+    for (int digit = 0; it != last && (digit = hex_value(*it)) >= 0; ++it, ++digits)
+      value = (value << 4) | static_cast<unsigned>(digit);
+
+    // embedded IPv4 tail
+    if (it != last && *it == '.')
+    {
+      basic_addr<4> dotted;
+      if (count > groups.size() - 2 || !try_parse<4>(group_begin, last, dotted))
+	return false;
+      groups[count++] = (dotted[0] << 8u) | dotted[1];
+      groups[count++] = (dotted[2] << 8u) | dotted[3];
+      break;
+    }
+
+    if (digits == 0 || digits > 4 || count == groups.size())
+      return false;
+    groups[count++] = value;
+
+    if (it == last)
+      break;
+    if (*it != ':' || ++it == last)
+      return false;
+    if (*it == ':')
+    {
+      if (gap != no_gap)
+	return false;
+      gap = count;
+      ++it;
+    }
+  }
+
+  if (gap != no_gap)
+  {
+    if (count == groups.size())
+      return false;
+    auto zeros = groups.size() - count;
+    std::move_backward(groups.begin() + gap, groups.begin() + count, groups.end());
+    std::fill(groups.begin() + gap, groups.begin() + gap + zeros, 0);
+  }
+  else if (count != groups.size())
+  {
+    return false;
+  }
+
+  for (size_t i = 0; i < groups.size(); ++i)
+  {
+    addr[2 * i] = static_cast<byte_t>(groups[i] >> 8);
+    addr[2 * i + 1] = static_cast<byte_t>(groups[i]);
+  }
+  return true;
 }
 
-ipv4::pool_t ipv4::filter_any_seq(const pool_t& ip_pool, int byte)
+template<>
+ip::basic_addr<16> ip::parse<16>(const char* first, const char* last)
 {
-  auto filtered_pool = pool_t();
+  auto addr = basic_addr<16>();
+  if (!try_parse<16>(first, last, addr))
+    throw std::invalid_argument("invalid IPv6 address: " + std::string(first, last));
+  return addr;
+}
 
-  std::copy_if(
-      std::begin(ip_pool)
-      , std::end(ip_pool)
-      , std::back_inserter(filtered_pool)
-      , [byte](const addr_t& addr)
-	{
-	  return (std::find(addr.cbegin(), addr.cend(), byte) != addr.cend());
-	}
-      );
+template<>
+size_t ip::format<4>(const basic_addr<4>& addr, char* buf)
+{
+  auto out = format_byte(buf, addr[0]);
+  for (size_t i = 1; i < addr.size(); ++i)
+  {
+    *out++ = '.';
+    out = format_byte(out, addr[i]);
+  }
+  return static_cast<size_t>(out - buf);
+}
+
+// RFC 5952: lowercase, no leading zeros, the longest (first of equal) run of
+// two or more zero groups is "::", IPv4-mapped addresses keep the dotted tail
+template<>
+size_t ip::format<16>(const basic_addr<16>& addr, char* buf)
+{
+  std::array<unsigned, 8> groups;
+  for (size_t i = 0; i < groups.size(); ++i)
+    groups[i] = (static_cast<unsigned>(addr[2 * i]) << 8) | addr[2 * i + 1];
 
-  return filtered_pool;
+  bool mapped = std::all_of(groups.begin(), groups.begin() + 5, [](unsigned g) {return g == 0;})
+    && groups[5] == 0xffff;
+  size_t hex_groups = mapped ? 6 : 8;
+
+  size_t best_begin = hex_groups, best_size = 1;
+  for (size_t i = 0; i < hex_groups;)
+  {
+    if (groups[i] != 0)
+    {
+      ++i;
+      continue;
+    }
+    auto run_begin = i;
+    while (i < hex_groups && groups[i] == 0)
+      ++i;
+    if (i - run_begin > best_size)
+    {
+      best_begin = run_begin;
+      best_size = i - run_begin;
+    }
+  }
+
+  auto out = buf;
+  for (size_t i = 0; i < hex_groups; ++i)
+  {
+    if (i == best_begin)
+    {
+      *out++ = ':';
+      *out++ = ':';
+      i += best_size - 1;
+      continue;
+    }
+    if (i != 0 && i != best_begin + best_size)
+      *out++ = ':';
+    out = format_hextet(out, groups[i]);
+  }
+
+  if (mapped)
+  {
+    if (best_begin + best_size != hex_groups)
+      *out++ = ':';
+    out += format(basic_addr<4>{{addr[12], addr[13], addr[14], addr[15]}}, out);
+  }
+  return static_cast<size_t>(out - buf);
+}
+
+template<>
+void ip::sort<4>(basic_pool<4>& ip_pool)
+{
+  auto keys = std::vector<key_t<4>>(ip_pool.size());
+  std::transform(std::begin(ip_pool), std::end(ip_pool), std::begin(keys), to_key<4>);
+  std::sort(std::begin(keys), std::end(keys), std::greater<key_t<4>>());
+  std::transform(std::begin(keys), std::end(keys), std::begin(ip_pool), from_key<4>);
+}
+
+template<>
+void ip::print<4>(std::ostream& stream, const basic_addr<4>* in, size_t n)
+{
+  const size_t chunk = 1024;
+  char buf[chunk * 16 + 16];
+  const auto& k = active_kernels();
+  for (size_t offset = 0; offset < n; offset += chunk)
+  {
+    auto len = k.format(in + offset, std::min(chunk, n - offset), buf);
+    stream.write(buf, static_cast<std::streamsize>(len));
+  }
+}
+
+template<>
+size_t ip::filter_prefix<4>(const basic_addr<4>* in, size_t n, const prefix<4>& pfx, basic_addr<4>* out)
+{
+  return active_kernels().filter_prefix(in, n, pfx, out);
+}
+
+template<>
+size_t ip::filter_prefix<16>(const basic_addr<16>* in, size_t n, const prefix<16>& pfx, basic_addr<16>* out)
+{
+#ifdef __SSE2__
+  const auto value = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pfx.value.data()));
+  const auto mask = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pfx.mask.data()));
+
+  size_t count = 0;
+  for (size_t i = 0; i < n; ++i)
+  {
+    auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in[i].data()));
+    out[count] = in[i];
+    count += (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(bytes, mask), value)) == 0xffff);
+  }
+  return count;
+#else
+  const auto value = to_key(pfx.value);
+  const auto mask = to_key(pfx.mask);
+  size_t count = 0;
+  for (size_t i = 0; i < n; ++i)
+  {
+    out[count] = in[i];
+    count += ((to_key(in[i]) & mask) == value);
+  }
+  return count;
+#endif
+}
+
+template<>
+size_t ip::filter_any<4>(const basic_addr<4>* in, size_t n, byte_t byte, basic_addr<4>* out)
+{
+  return active_kernels().filter_any(in, n, byte, out);
+}
+
+template<>
+size_t ip::filter_any<16>(const basic_addr<16>* in, size_t n, byte_t byte, basic_addr<16>* out)
+{
+#ifdef __SSE2__
+  const auto pattern = _mm_set1_epi8(static_cast<char>(byte));
+
+  size_t count = 0;
+  for (size_t i = 0; i < n; ++i)
+  {
+    auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in[i].data()));
+    out[count] = in[i];
+    count += (_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, pattern)) != 0);
+  }
+  return count;
+#else
+  const auto end = std::copy_if(in, in + n, out
+      , [byte](const basic_addr<16>& addr) {return (std::find(addr.cbegin(), addr.cend(), byte) != addr.cend());});
+  return static_cast<size_t>(end - out);
+#endif
 }
 
-std::vector<std::string> ipv4::split(const std::string &str, char d)
+std::vector<std::string> ip::split(const std::string &str, char d)
 {
   std::vector<std::string> r;
 
@@ -94,14 +354,15 @@ std::vector<std::string> ipv4::split(const std::string &str, char d)
 
 ipv4::addr_t ipv4::to_addr(const std::vector<std::string>& addr_str)
 {
-  auto addr = addr_t(addr_str.size(), 0);
+  auto addr = addr_t();
   std::transform(
       std::begin(addr_str)
-      , std::end(addr_str)
+      , std::begin(addr_str) + static_cast<std::ptrdiff_t>(std::min(addr_str.size(), addr.size()))
       , std::begin(addr)
       , [](const std::string& byte_str)
 	{
 	  char * end = nullptr;
+	  errno = 0;
 	  long byte = std::strtol(byte_str.c_str(), &end, 10);
 	  if ((errno == ERANGE)
 	    ||(end && *end != '\0')
@@ -119,20 +380,10 @@ ipv4::addr_t ipv4::to_addr(const std::vector<std::string>& addr_str)
 
 ipv4::addr_t ipv4::to_addr(const std::string& addr_str)
 {
-  auto addr = addr_t();
-  addr.reserve(4);
-  addr.push_back(0);
-  for (const auto& sym : addr_str)
-  {
-    if (sym == '.')
-    {
-      addr.push_back(0);
-    }
-    else
-    {
-      addr.back() *= 10;
-      addr.back() += static_cast<byte_t>(sym) - 48; // ASCII offset of '0'
-    }
-  }
-  return addr;
+  return ip::parse<width>(addr_str);
+}
+
+ipv6::addr_t ipv6::to_addr(const std::string& addr_str)
+{
+  return ip::parse<width>(addr_str);
 }
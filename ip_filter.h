@@ -2,51 +2,403 @@
 
 #include <string>
 #include <vector>
+#include <array>
 #include <iostream>
 #include <algorithm>
+#include <memory>
 #include <stdint.h>
 
-namespace ipv4
+namespace ip
 {
 
   using byte_t = uint8_t;
-  using addr_t = std::vector<byte_t>;
-  using pool_t = std::vector<addr_t>;
+  __extension__ typedef unsigned __int128 uint128_t;
+
+  //! address of Width bytes in network byte order
+  template<size_t Width>
+  using basic_addr = std::array<byte_t, Width>;
+
+  //! any standard allocator works, see arena.h for a reusable one
+  template<size_t Width, typename Allocator = std::allocator<basic_addr<Width>>>
+  using basic_pool = std::vector<basic_addr<Width>, Allocator>;
+
+  //! per-family packed key type and text limits
+  template<size_t Width>
+  struct traits;
+
+  template<>
+  struct traits<4>
+  {
+    using key_t = uint32_t;
+    static constexpr size_t max_text = 15; // "255.255.255.255"
+  };
+
+  template<>
+  struct traits<16>
+  {
+    using key_t = uint128_t;
+    static constexpr size_t max_text = 45; // "ffff:ffff:ffff:ffff:ffff:ffff:255.255.255.255"
+  };
+
+  template<size_t Width>
+  using key_t = typename traits<Width>::key_t;
+
+  //! packs address bytes into a big-endian integer key, so that key order is address order
+  template<size_t Width>
+  key_t<Width> to_key(const basic_addr<Width>& addr)
+  {
+    auto key = key_t<Width>();
+    for (const auto& addr_byte : addr)
+      key = static_cast<key_t<Width>>((key << 8) | addr_byte);
+    return key;
+  }
+
+  template<size_t Width>
+  basic_addr<Width> from_key(key_t<Width> key)
+  {
+    auto addr = basic_addr<Width>();
+    for (size_t i = Width; i-- > 0; key >>= 8)
+      addr[i] = static_cast<byte_t>(key);
+    return addr;
+  }
+
+  //! key mask of the leading length bits
+  template<size_t Width>
+  key_t<Width> prefix_mask(unsigned length)
+  {
+    return (length == 0) ? key_t<Width>(0) : static_cast<key_t<Width>>(~key_t<Width>() << (Width * 8 - length));
+  }
+
+  //! 64-bit mix of a packed key, shared by the probabilistic structures
+  inline uint64_t hash_key(uint64_t key)
+  {
+    // murmur3 finalizer
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ull;
+    key ^= key >> 33;
+    return key;
+  }
+
+  inline uint64_t hash_key(uint32_t key)
+  {
+    return hash_key(static_cast<uint64_t>(key));
+  }
+
+  inline uint64_t hash_key(uint128_t key)
+  {
+    return hash_key(static_cast<uint64_t>(key >> 64) ^ hash_key(static_cast<uint64_t>(key)));
+  }
+
+  template<size_t Width>
+  uint64_t hash(const basic_addr<Width>& addr)
+  {
+    return hash_key(to_key(addr));
+  }
 
   std::vector<std::string> split(const std::string &str, char d);
-  addr_t to_addr(const std::vector<std::string> &str); //! converts vector of bytes {"xxx", "xxx", "xxx", "XXX"}
-  addr_t to_addr(const std::string& addr_str);	       //! converts address of  "xxx.xxx.xxx.xxx" format
 
-  void print(std::ostream&, const pool_t&);
-  void print(std::ostream& stream, const addr_t& ip_addr);
+  //! allocation free split: calls sink(first, last) for every field of [first, last)
+  template<typename Sink>
+  void split(const char* first, const char* last, char d, Sink sink)
+  {
+    for (;;)
+    {
+      auto stop = std::find(first, last, d);
+      sink(first, stop);
+      if (stop == last)
+	break;
+      first = stop + 1;
+    }
+  }
+
+  //! parses textual address from [first, last); only 4 and 16 byte families are defined
+  //!
+  //! parse<4>() is lenient and takes anything, parse<16>() throws
+  //! std::invalid_argument on malformed text
+  template<size_t Width>
+  basic_addr<Width> parse(const char* first, const char* last);
 
-  void sort(pool_t& ip_pool);
+  //! strict parse of a dotted quad or an RFC 4291 text address, returns false on malformed text
+  template<size_t Width>
+  bool try_parse(const char* first, const char* last, basic_addr<Width>& addr);
 
-  template<size_t N>
-  bool bytesPredicate(const addr_t&)
+  //! writes textual address to buf (at least traits<Width>::max_text bytes), returns its length
+  template<size_t Width>
+  size_t format(const basic_addr<Width>& addr, char* buf);
+
+  template<> basic_addr<4> parse<4>(const char* first, const char* last);
+  template<> basic_addr<16> parse<16>(const char* first, const char* last);
+  template<> bool try_parse<4>(const char* first, const char* last, basic_addr<4>& addr);
+  template<> bool try_parse<16>(const char* first, const char* last, basic_addr<16>& addr);
+  template<> size_t format<4>(const basic_addr<4>& addr, char* buf);
+  template<> size_t format<16>(const basic_addr<16>& addr, char* buf);
+
+  template<size_t Width>
+  basic_addr<Width> parse(const std::string& addr_str)
+  {
+    return parse<Width>(addr_str.data(), addr_str.data() + addr_str.size());
+  }
+
+  template<size_t Width>
+  void print(std::ostream& stream, const basic_addr<Width>& ip_addr)
+  {
+    char buf[traits<Width>::max_text];
+    stream.write(buf, static_cast<std::streamsize>(format(ip_addr, buf)));
+  }
+
+  //! one address per line
+  template<size_t Width>
+  void print(std::ostream& stream, const basic_addr<Width>* in, size_t n)
+  {
+    char buf[traits<Width>::max_text + 1];
+    for (size_t i = 0; i < n; ++i)
+    {
+      auto len = format(in[i], buf);
+      buf[len] = '\n';
+      stream.write(buf, static_cast<std::streamsize>(len + 1));
+    }
+  }
+
+  //! formats in batches with the active IPv4 kernel
+  template<> void print<4>(std::ostream& stream, const basic_addr<4>* in, size_t n);
+
+  template<size_t Width, typename Allocator>
+  void print(std::ostream& stream, const basic_pool<Width, Allocator>& ip_pool)
+  {
+    print<Width>(stream, ip_pool.data(), ip_pool.size());
+  }
+
+  //! sorts in descending order with a byte-wise LSD radix sort, the buffer
+  //! comes from the pool's allocator and the histograms live on the stack
+  template<size_t Width, typename Allocator>
+  void sort(basic_pool<Width, Allocator>& ip_pool)
+  {
+    if (ip_pool.size() < 64)
+    {
+      std::sort(std::begin(ip_pool), std::end(ip_pool), std::greater<basic_addr<Width>>());
+      return;
+    }
+
+    // all histograms are gathered in a single pass; digits where every address
+    // falls into the same bucket are skipped
+    std::array<std::array<size_t, 256>, Width> counts{};
+    for (const auto& addr : ip_pool)
+      for (size_t i = 0; i < Width; ++i)
+	++counts[i][addr[i]];
+
+    auto buffer = basic_pool<Width, Allocator>(ip_pool.size(), ip_pool.get_allocator());
+    auto* src = &ip_pool;
+    auto* dst = &buffer;
+    for (size_t i = Width; i-- > 0;)
+    {
+      auto& count = counts[i];
+      if (count[ip_pool.front()[i]] == ip_pool.size())
+	continue;
+
+      size_t offset = 0;
+      for (size_t bucket = count.size(); bucket-- > 0;)
+      {
+	auto bucket_size = count[bucket];
+	count[bucket] = offset;
+	offset += bucket_size;
+      }
+
+      for (const auto& addr : *src)
+	(*dst)[count[addr[i]]++] = addr;
+      std::swap(src, dst);
+    }
+
+    if (src != &ip_pool)
+      ip_pool.swap(buffer);
+  }
+
+  //! packs addresses to 32-bit keys and sorts those
+  template<> void sort<4>(basic_pool<4>& ip_pool);
+
+  //! leading bytes mask/value pair
+  template<size_t Width>
+  struct prefix
+  {
+    basic_addr<Width> value;
+    basic_addr<Width> mask;
+
+    bool match(const basic_addr<Width>& addr) const
+    {
+      for (size_t i = 0; i < Width; ++i)
+	if ((addr[i] & mask[i]) != value[i])
+	  return false;
+      return true;
+    }
+  };
+
+  template<size_t Width, typename... Args>
+  prefix<Width> make_prefix(Args... args)
+  {
+    static_assert(sizeof...(args) <= Width, "too many bytes for the address family");
+    const int bytes[] = {args..., 0};
+    auto result = prefix<Width>{basic_addr<Width>(), basic_addr<Width>()};
+    for (size_t i = 0; i < sizeof...(args); ++i)
+    {
+      // out of range bytes never match, as the former bytesPredicate did
+      if (bytes[i] < 0 || bytes[i] > 0xff)
+      {
+	result.value.fill(0xff);
+	result.mask.fill(0);
+	return result;
+      }
+      result.value[i] = static_cast<byte_t>(bytes[i]);
+      result.mask[i] = 0xff;
+    }
+    return result;
+  }
+
+  template<size_t N, typename Addr>
+  bool bytesPredicate(const Addr&)
   {
     return true;
   }
 
-  template<size_t N, typename... Args>
-  bool bytesPredicate(const addr_t& addr, int byte, Args... args)
+  template<size_t N, typename Addr, typename... Args>
+  bool bytesPredicate(const Addr& addr, int byte, Args... args)
   {
     return ((addr.at(N) == byte) && bytesPredicate<N+1>(addr, args...));
   }
 
-  pool_t filter_any(const pool_t& ip_pool, int byte);
-  pool_t filter_any_seq(const pool_t& ip_pool, int byte);
+  //! copies the addresses of [in, in + n) matching pfx to out (room for n), returns their number
+  template<size_t Width>
+  size_t filter_prefix(const basic_addr<Width>* in, size_t n, const prefix<Width>& pfx, basic_addr<Width>* out)
+  {
+    return static_cast<size_t>(std::copy_if(in, in + n, out, [&pfx](const basic_addr<Width>& addr) {return pfx.match(addr);}) - out);
+  }
+
+  //! runs the active IPv4 kernel, see dispatch.h
+  template<> size_t filter_prefix<4>(const basic_addr<4>* in, size_t n, const prefix<4>& pfx, basic_addr<4>* out);
+  //! compares all 16 bytes at once with SSE2 where available
+  template<> size_t filter_prefix<16>(const basic_addr<16>* in, size_t n, const prefix<16>& pfx, basic_addr<16>* out);
+
+  //! copies the addresses of [in, in + n) holding byte anywhere to out (room for n), returns their number
+  template<size_t Width>
+  size_t filter_any(const basic_addr<Width>* in, size_t n, byte_t byte, basic_addr<Width>* out)
+  {
+    return static_cast<size_t>(std::copy_if(in, in + n, out
+	  , [byte](const basic_addr<Width>& addr) {return (std::find(addr.cbegin(), addr.cend(), byte) != addr.cend());}) - out);
+  }
+
+  //! runs the active IPv4 kernel, see dispatch.h
+  template<> size_t filter_any<4>(const basic_addr<4>* in, size_t n, byte_t byte, basic_addr<4>* out);
+  //! byte-wise SSE2 compare of the whole address where available
+  template<> size_t filter_any<16>(const basic_addr<16>* in, size_t n, byte_t byte, basic_addr<16>* out);
+
+  //! appends the matches to filtered_pool a chunk at a time, so a reused
+  //! pool allocates nothing once it has grown large enough
+  template<size_t Width, typename InAllocator, typename OutAllocator>
+  void filter_prefix(const basic_pool<Width, InAllocator>& ip_pool, const prefix<Width>& pfx, basic_pool<Width, OutAllocator>& filtered_pool)
+  {
+    const size_t chunk = 1024;
+    basic_addr<Width> matches[chunk];
+    for (size_t offset = 0; offset < ip_pool.size(); offset += chunk)
+    {
+      auto count = filter_prefix<Width>(ip_pool.data() + offset, std::min(chunk, ip_pool.size() - offset), pfx, matches);
+      filtered_pool.insert(filtered_pool.end(), matches, matches + count);
+    }
+  }
+
+  //! the result shares the allocator of ip_pool
+  template<size_t Width, typename Allocator>
+  basic_pool<Width, Allocator> filter_prefix(const basic_pool<Width, Allocator>& ip_pool, const prefix<Width>& pfx)
+  {
+    auto filtered_pool = basic_pool<Width, Allocator>(ip_pool.get_allocator());
+    filter_prefix(ip_pool, pfx, filtered_pool);
+    return filtered_pool;
+  }
+
+  template<size_t Width, typename Allocator, typename... Args>
+  basic_pool<Width, Allocator> filter(const basic_pool<Width, Allocator>& ip_pool, Args... args)
+  {
+    return filter_prefix(ip_pool, make_prefix<Width>(args...));
+  }
 
-  template<typename... Args>
-  pool_t filter(const pool_t& ip_pool, Args... args)
+  template<size_t Width, typename Allocator>
+  basic_pool<Width, Allocator> filter_any_seq(const basic_pool<Width, Allocator>& ip_pool, int byte)
   {
-    auto filtered_pool = pool_t();
+    auto filtered_pool = basic_pool<Width, Allocator>(ip_pool.get_allocator());
+
     std::copy_if(
 	std::begin(ip_pool)
 	, std::end(ip_pool)
 	, std::back_inserter(filtered_pool)
-	, [args...](const addr_t& addr) {return bytesPredicate<0>(addr, args...);}
+	, [byte](const basic_addr<Width>& addr)
+	  {
+	    return (std::find(addr.cbegin(), addr.cend(), byte) != addr.cend());
+	  }
 	);
+
+    return filtered_pool;
+  }
+
+  template<size_t Width, typename InAllocator, typename OutAllocator>
+  void filter_any(const basic_pool<Width, InAllocator>& ip_pool, int byte, basic_pool<Width, OutAllocator>& filtered_pool)
+  {
+    if (byte < 0 || byte > 0xff)
+      return;
+
+    const size_t chunk = 1024;
+    basic_addr<Width> matches[chunk];
+    for (size_t offset = 0; offset < ip_pool.size(); offset += chunk)
+    {
+      auto count = filter_any<Width>(ip_pool.data() + offset, std::min(chunk, ip_pool.size() - offset), static_cast<byte_t>(byte), matches);
+      filtered_pool.insert(filtered_pool.end(), matches, matches + count);
+    }
+  }
+
+  template<size_t Width, typename Allocator>
+  basic_pool<Width, Allocator> filter_any(const basic_pool<Width, Allocator>& ip_pool, int byte)
+  {
+    auto filtered_pool = basic_pool<Width, Allocator>(ip_pool.get_allocator());
+    filter_any(ip_pool, byte, filtered_pool);
     return filtered_pool;
   }
 }
+
+namespace ipv4
+{
+
+  constexpr size_t width = 4;
+
+  using byte_t = ip::byte_t;
+  using addr_t = ip::basic_addr<width>;
+  using pool_t = ip::basic_pool<width>;
+
+  using ip::split;
+  using ip::print;
+  using ip::sort;
+  using ip::bytesPredicate;
+  using ip::filter;
+  using ip::filter_any;
+  using ip::filter_any_seq;
+
+  addr_t to_addr(const std::vector<std::string> &str); //! converts vector of bytes {"xxx", "xxx", "xxx", "XXX"}
+  addr_t to_addr(const std::string& addr_str);	       //! converts address of  "xxx.xxx.xxx.xxx" format
+}
+
+namespace ipv6
+{
+
+  constexpr size_t width = 16;
+
+  using byte_t = ip::byte_t;
+  using addr_t = ip::basic_addr<width>;
+  using pool_t = ip::basic_pool<width>;
+
+  using ip::split;
+  using ip::print;
+  using ip::sort;
+  using ip::bytesPredicate;
+  using ip::filter;
+  using ip::filter_any;
+  using ip::filter_any_seq;
+
+  addr_t to_addr(const std::string& addr_str);	       //! converts address of "x:x:x:x:x:x:x:x" format, "::" compression and trailing dotted quad included
+}
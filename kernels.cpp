@@ -0,0 +1,506 @@
+#include "dispatch.h"
+#include "text.h"
+
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define IP_FILTER_X86
+#  include <immintrin.h>
+#endif
+
+namespace
+{
+  using ip::byte_t;
+  using ip::is_space;
+  using addr_t = ip::basic_addr<4>;
+
+  const char* skip_blanks(const char* first, const char* last)
+  {
+    while (first != last && *first != '\n' && is_space(*first))
+      ++first;
+    return first;
+  }
+
+  const char* parse_field_scalar(const char* first, const char* last, addr_t* out, size_t& count)
+  {
+    auto field_end = first;
+    while (field_end != last && !is_space(*field_end))
+      ++field_end;
+    if (first != field_end && ip::try_parse<4>(first, field_end, out[count]))
+      ++count;
+    return field_end;
+  }
+
+  const char* next_line_scalar(const char* first, const char* last)
+  {
+    while (first != last && *first != '\n')
+      ++first;
+    return (first == last) ? last : first + 1;
+  }
+
+  // address bytes as a native order word, good for byte-wise equality only
+  uint32_t load_word(const addr_t& addr)
+  {
+    uint32_t word;
+    std::memcpy(&word, addr.data(), sizeof(word));
+    return word;
+  }
+
+  bool has_byte(uint32_t word, uint32_t pattern)
+  {
+    auto diff = word ^ pattern; // zero byte where word matches
+    return (((diff - 0x01010101u) & ~diff & 0x80808080u) != 0);
+  }
+
+  size_t filter_prefix_tail(const addr_t* in, size_t n, uint32_t mask, uint32_t value, addr_t* out)
+  {
+    size_t count = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+      out[count] = in[i];
+      count += ((load_word(in[i]) & mask) == value);
+    }
+    return count;
+  }
+
+  size_t filter_any_tail(const addr_t* in, size_t n, uint32_t pattern, addr_t* out)
+  {
+    size_t count = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+      out[count] = in[i];
+      count += has_byte(load_word(in[i]), pattern);
+    }
+    return count;
+  }
+
+  size_t read_scalar(const char*& first, const char* last, addr_t* out, size_t n)
+  {
+    size_t count = 0;
+    while (first != last && count < n)
+    {
+      auto field_end = parse_field_scalar(skip_blanks(first, last), last, out, count);
+      first = next_line_scalar(field_end, last);
+    }
+    return count;
+  }
+
+  size_t filter_prefix_scalar(const addr_t* in, size_t n, const ip::prefix<4>& pfx, addr_t* out)
+  {
+    return filter_prefix_tail(in, n, load_word(pfx.mask), load_word(pfx.value), out);
+  }
+
+  size_t filter_any_scalar(const addr_t* in, size_t n, byte_t byte, addr_t* out)
+  {
+    return filter_any_tail(in, n, 0x01010101u * byte, out);
+  }
+
+  size_t format_scalar(const addr_t* in, size_t n, char* out)
+  {
+    auto begin = out;
+    for (size_t i = 0; i < n; ++i)
+    {
+      out += ip::format(in[i], out);
+      *out++ = '\n';
+    }
+    return static_cast<size_t>(out - begin);
+  }
+
+  const ip::kernels scalar_kernels = {"scalar", read_scalar, filter_prefix_scalar, filter_any_scalar, format_scalar};
+
+#ifdef IP_FILTER_X86
+
+  // byte shuffles keyed by the digit counts (1..3 each) of the four groups,
+  // index is (l0 - 1) * 27 + (l1 - 1) * 9 + (l2 - 1) * 3 + (l3 - 1)
+  struct shuffle_tables
+  {
+    // text "d.d.d.d" -> four words of {hundreds, tens, ones, 0}
+    byte_t parse[81][16];
+    // four words of {digits..., terminator} -> packed text line
+    byte_t format[81][16];
+    // decimal text of every byte followed by '.' or '\n', and its digit count
+    uint32_t dotted[256];
+    uint32_t line_end[256];
+    byte_t digits[256];
+  };
+
+  shuffle_tables make_shuffle_tables()
+  {
+    shuffle_tables tables;
+    std::memset(&tables, 0x80, sizeof(tables));
+
+    for (size_t index = 0; index < 81; ++index)
+    {
+      const size_t lengths[] = {index / 27 + 1, index / 9 % 3 + 1, index / 3 % 3 + 1, index % 3 + 1};
+
+      size_t group_begin = 0, out = 0;
+      for (size_t group = 0; group < 4; ++group)
+      {
+	auto length = lengths[group];
+	for (size_t digit = 0; digit < 3; ++digit)
+	  if (3 - digit <= length)
+	    tables.parse[index][4 * group + digit] = static_cast<byte_t>(group_begin + length - (3 - digit));
+	group_begin += length + 1;
+
+	for (size_t i = 0; i <= length; ++i)
+	  tables.format[index][out++] = static_cast<byte_t>(4 * group + i);
+      }
+    }
+
+    for (unsigned byte = 0; byte < 256; ++byte)
+    {
+      char text[ip::traits<4>::max_text] = {};
+      auto length = ip::format(addr_t{{static_cast<byte_t>(byte), 0, 0, 0}}, text) - 6; // "d.0.0.0"
+      tables.digits[byte] = static_cast<byte_t>(length);
+      text[length] = '.';
+      std::memcpy(&tables.dotted[byte], text, sizeof(uint32_t));
+      text[length] = '\n';
+      std::memcpy(&tables.line_end[byte], text, sizeof(uint32_t));
+    }
+    return tables;
+  }
+
+  const shuffle_tables& tables()
+  {
+    static const shuffle_tables instance = make_shuffle_tables();
+    return instance;
+  }
+
+  // parses a dotted quad of four 1..3 digit groups that ends in a blank,
+  // anything else (or less than 16 readable bytes) goes to try_parse<4>()
+  __attribute__((target("sse4.2")))
+  const char* parse_field_sse42(const char* first, const char* last, addr_t* out, size_t& count, const shuffle_tables& t)
+  {
+    if (last - first < 16)
+      return parse_field_scalar(first, last, out, count);
+
+    auto text = _mm_loadu_si128(reinterpret_cast<const __m128i*>(first));
+    auto digits = _mm_sub_epi8(text, _mm_set1_epi8('0'));
+    auto is_digit = _mm_cmpeq_epi8(_mm_min_epu8(digits, _mm_set1_epi8(9)), digits);
+    auto is_dot = _mm_cmpeq_epi8(text, _mm_set1_epi8('.'));
+
+    auto valid = static_cast<unsigned>(_mm_movemask_epi8(_mm_or_si128(is_digit, is_dot)));
+    auto length = static_cast<unsigned>(__builtin_ctz(~valid)); // at most 16
+    if (length == 16 || !is_space(first[length]))
+      return parse_field_scalar(first, last, out, count);
+
+    auto dots = static_cast<unsigned>(_mm_movemask_epi8(is_dot)) & ((1u << length) - 1);
+    if (__builtin_popcount(dots) != 3)
+      return parse_field_scalar(first, last, out, count);
+
+    auto d0 = static_cast<unsigned>(__builtin_ctz(dots));
+    dots &= dots - 1;
+    auto d1 = static_cast<unsigned>(__builtin_ctz(dots));
+    dots &= dots - 1;
+    auto d2 = static_cast<unsigned>(__builtin_ctz(dots));
+    const unsigned lengths[] = {d0, d1 - d0 - 1, d2 - d1 - 1, length - d2 - 1};
+    for (auto group_length : lengths)
+      if (group_length - 1 > 2)
+	return parse_field_scalar(first, last, out, count);
+
+    auto index = (lengths[0] - 1) * 27 + (lengths[1] - 1) * 9 + (lengths[2] - 1) * 3 + (lengths[3] - 1);
+    auto groups = _mm_shuffle_epi8(digits, _mm_loadu_si128(reinterpret_cast<const __m128i*>(t.parse[index])));
+    auto pairs = _mm_maddubs_epi16(groups, _mm_set1_epi32(0x00010a64)); // {100, 10, 1, 0}
+    auto values = _mm_madd_epi16(pairs, _mm_set1_epi16(1));
+    if (_mm_movemask_epi8(_mm_cmpgt_epi32(values, _mm_set1_epi32(0xff))) != 0)
+      return first + length; // a group above 255 is malformed, as in try_parse<4>()
+    auto packed = _mm_shuffle_epi8(values, _mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1));
+
+    auto word = static_cast<uint32_t>(_mm_cvtsi128_si32(packed));
+    std::memcpy(out[count++].data(), &word, sizeof(word));
+    return first + length;
+  }
+
+  __attribute__((target("sse4.2")))
+  const char* next_line_sse42(const char* first, const char* last)
+  {
+    for (; last - first >= 16; first += 16)
+    {
+      auto text = _mm_loadu_si128(reinterpret_cast<const __m128i*>(first));
+      auto newlines = _mm_movemask_epi8(_mm_cmpeq_epi8(text, _mm_set1_epi8('\n')));
+      if (newlines != 0)
+	return first + __builtin_ctz(static_cast<unsigned>(newlines)) + 1;
+    }
+    return next_line_scalar(first, last);
+  }
+
+  __attribute__((target("avx2")))
+  const char* next_line_avx2(const char* first, const char* last)
+  {
+    for (; last - first >= 32; first += 32)
+    {
+      auto text = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(first));
+      auto newlines = _mm256_movemask_epi8(_mm256_cmpeq_epi8(text, _mm256_set1_epi8('\n')));
+      if (newlines != 0)
+	return first + __builtin_ctz(static_cast<unsigned>(newlines)) + 1;
+    }
+    return next_line_scalar(first, last);
+  }
+
+  __attribute__((target("avx512f,avx512bw")))
+  const char* next_line_avx512(const char* first, const char* last)
+  {
+    for (; last - first >= 64; first += 64)
+    {
+      auto text = _mm512_loadu_si512(first);
+      auto newlines = _mm512_cmpeq_epi8_mask(text, _mm512_set1_epi8('\n'));
+      if (newlines != 0)
+	return first + __builtin_ctzll(newlines) + 1;
+    }
+    return next_line_scalar(first, last);
+  }
+
+  __attribute__((target("sse4.2")))
+  size_t read_sse42(const char*& first, const char* last, addr_t* out, size_t n)
+  {
+    const auto& t = tables();
+    size_t count = 0;
+    while (first != last && count < n)
+    {
+      auto field_end = parse_field_sse42(skip_blanks(first, last), last, out, count, t);
+      first = next_line_sse42(field_end, last);
+    }
+    return count;
+  }
+
+  __attribute__((target("avx2")))
+  size_t read_avx2(const char*& first, const char* last, addr_t* out, size_t n)
+  {
+    const auto& t = tables();
+    size_t count = 0;
+    while (first != last && count < n)
+    {
+      auto field_end = parse_field_sse42(skip_blanks(first, last), last, out, count, t);
+      first = next_line_avx2(field_end, last);
+    }
+    return count;
+  }
+
+  __attribute__((target("avx512f,avx512bw")))
+  size_t read_avx512(const char*& first, const char* last, addr_t* out, size_t n)
+  {
+    const auto& t = tables();
+    size_t count = 0;
+    while (first != last && count < n)
+    {
+      auto field_end = parse_field_sse42(skip_blanks(first, last), last, out, count, t);
+      first = next_line_avx512(field_end, last);
+    }
+    return count;
+  }
+
+  __attribute__((target("sse4.2")))
+  size_t filter_prefix_sse42(const addr_t* in, size_t n, const ip::prefix<4>& pfx, addr_t* out)
+  {
+    const auto mask = _mm_set1_epi32(static_cast<int>(load_word(pfx.mask)));
+    const auto value = _mm_set1_epi32(static_cast<int>(load_word(pfx.value)));
+
+    size_t i = 0, count = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+      auto addrs = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+      auto matches = static_cast<unsigned>(_mm_movemask_ps(_mm_castsi128_ps(
+	      _mm_cmpeq_epi32(_mm_and_si128(addrs, mask), value))));
+      for (size_t j = 0; j < 4; ++j)
+      {
+	out[count] = in[i + j];
+	count += (matches >> j) & 1;
+      }
+    }
+    return count + filter_prefix_tail(in + i, n - i, load_word(pfx.mask), load_word(pfx.value), out + count);
+  }
+
+  __attribute__((target("sse4.2")))
+  size_t filter_any_sse42(const addr_t* in, size_t n, byte_t byte, addr_t* out)
+  {
+    const auto pattern = _mm_set1_epi8(static_cast<char>(byte));
+
+    size_t i = 0, count = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+      auto addrs = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+      auto misses = _mm_cmpeq_epi32(_mm_cmpeq_epi8(addrs, pattern), _mm_setzero_si128());
+      auto matches = ~static_cast<unsigned>(_mm_movemask_ps(_mm_castsi128_ps(misses)));
+      for (size_t j = 0; j < 4; ++j)
+      {
+	out[count] = in[i + j];
+	count += (matches >> j) & 1;
+      }
+    }
+    return count + filter_any_tail(in + i, n - i, 0x01010101u * byte, out + count);
+  }
+
+  __attribute__((target("avx2")))
+  size_t filter_prefix_avx2(const addr_t* in, size_t n, const ip::prefix<4>& pfx, addr_t* out)
+  {
+    const auto mask = _mm256_set1_epi32(static_cast<int>(load_word(pfx.mask)));
+    const auto value = _mm256_set1_epi32(static_cast<int>(load_word(pfx.value)));
+
+    size_t i = 0, count = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+      auto addrs = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+      auto matches = static_cast<unsigned>(_mm256_movemask_ps(_mm256_castsi256_ps(
+	      _mm256_cmpeq_epi32(_mm256_and_si256(addrs, mask), value))));
+      for (size_t j = 0; j < 8; ++j)
+      {
+	out[count] = in[i + j];
+	count += (matches >> j) & 1;
+      }
+    }
+    return count + filter_prefix_tail(in + i, n - i, load_word(pfx.mask), load_word(pfx.value), out + count);
+  }
+
+  __attribute__((target("avx2")))
+  size_t filter_any_avx2(const addr_t* in, size_t n, byte_t byte, addr_t* out)
+  {
+    const auto pattern = _mm256_set1_epi8(static_cast<char>(byte));
+
+    size_t i = 0, count = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+      auto addrs = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+      auto misses = _mm256_cmpeq_epi32(_mm256_cmpeq_epi8(addrs, pattern), _mm256_setzero_si256());
+      auto matches = ~static_cast<unsigned>(_mm256_movemask_ps(_mm256_castsi256_ps(misses)));
+      for (size_t j = 0; j < 8; ++j)
+      {
+	out[count] = in[i + j];
+	count += (matches >> j) & 1;
+      }
+    }
+    return count + filter_any_tail(in + i, n - i, 0x01010101u * byte, out + count);
+  }
+
+  // masked loads cover the tail, compress stores pack the matches
+  __attribute__((target("avx512f,avx512bw")))
+  size_t filter_prefix_avx512(const addr_t* in, size_t n, const ip::prefix<4>& pfx, addr_t* out)
+  {
+    const auto mask = _mm512_set1_epi32(static_cast<int>(load_word(pfx.mask)));
+    const auto value = _mm512_set1_epi32(static_cast<int>(load_word(pfx.value)));
+
+    size_t count = 0;
+    for (size_t i = 0; i < n; i += 16)
+    {
+      auto lanes = static_cast<__mmask16>(n - i >= 16 ? 0xffff : (1u << (n - i)) - 1);
+      auto addrs = _mm512_maskz_loadu_epi32(lanes, in + i);
+      auto matches = _mm512_mask_cmpeq_epi32_mask(lanes, _mm512_and_si512(addrs, mask), value);
+      _mm512_mask_compressstoreu_epi32(out + count, matches, addrs);
+      count += static_cast<size_t>(__builtin_popcount(matches));
+    }
+    return count;
+  }
+
+  __attribute__((target("avx512f,avx512bw")))
+  size_t filter_any_avx512(const addr_t* in, size_t n, byte_t byte, addr_t* out)
+  {
+    const auto pattern = _mm512_set1_epi8(static_cast<char>(byte));
+
+    size_t count = 0;
+    for (size_t i = 0; i < n; i += 16)
+    {
+      auto lanes = static_cast<__mmask16>(n - i >= 16 ? 0xffff : (1u << (n - i)) - 1);
+      auto addrs = _mm512_maskz_loadu_epi32(lanes, in + i);
+      auto hits = _mm512_movm_epi8(_mm512_cmpeq_epi8_mask(addrs, pattern));
+      auto matches = _mm512_mask_test_epi32_mask(lanes, hits, hits);
+      _mm512_mask_compressstoreu_epi32(out + count, matches, addrs);
+      count += static_cast<size_t>(__builtin_popcount(matches));
+    }
+    return count;
+  }
+
+  // digit strings of the four bytes are packed into one register and
+  // squeezed together with a single shuffle
+  __attribute__((target("sse4.2")))
+  size_t format_sse42(const addr_t* in, size_t n, char* out)
+  {
+    const auto& t = tables();
+    auto begin = out;
+    for (size_t i = 0; i < n; ++i)
+    {
+      const auto& addr = in[i];
+      auto text = _mm_setr_epi32(
+	  static_cast<int>(t.dotted[addr[0]])
+	  , static_cast<int>(t.dotted[addr[1]])
+	  , static_cast<int>(t.dotted[addr[2]])
+	  , static_cast<int>(t.line_end[addr[3]])
+	  );
+      auto index = (t.digits[addr[0]] - 1) * 27 + (t.digits[addr[1]] - 1) * 9 + (t.digits[addr[2]] - 1) * 3 + (t.digits[addr[3]] - 1);
+      auto line = _mm_shuffle_epi8(text, _mm_loadu_si128(reinterpret_cast<const __m128i*>(t.format[index])));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out), line);
+      out += t.digits[addr[0]] + t.digits[addr[1]] + t.digits[addr[2]] + t.digits[addr[3]] + 4;
+    }
+    return static_cast<size_t>(out - begin);
+  }
+
+  // the formatter is bound by the table lookups, wider registers do not help it
+  const ip::kernels sse42_kernels = {"sse4.2", read_sse42, filter_prefix_sse42, filter_any_sse42, format_sse42};
+  const ip::kernels avx2_kernels = {"avx2", read_avx2, filter_prefix_avx2, filter_any_avx2, format_sse42};
+  const ip::kernels avx512_kernels = {"avx512", read_avx512, filter_prefix_avx512, filter_any_avx512, format_sse42};
+
+#endif // IP_FILTER_X86
+
+  bool cpu_supports(const ip::kernels& candidate)
+  {
+#ifdef IP_FILTER_X86
+    __builtin_cpu_init();
+    if (&candidate == &sse42_kernels)
+      return __builtin_cpu_supports("sse4.2");
+    if (&candidate == &avx2_kernels)
+      return __builtin_cpu_supports("avx2");
+    if (&candidate == &avx512_kernels)
+      return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+#endif
+    return (&candidate == &scalar_kernels);
+  }
+
+  const ip::kernels* const all_kernels[] = {
+      &scalar_kernels
+#ifdef IP_FILTER_X86
+      , &sse42_kernels
+      , &avx2_kernels
+      , &avx512_kernels
+#endif
+    };
+
+  std::atomic<const ip::kernels*> selected_kernels(nullptr);
+}
+
+std::vector<const ip::kernels*> ip::supported_kernels()
+{
+  auto supported = std::vector<const kernels*>();
+  for (auto candidate : all_kernels)
+    if (cpu_supports(*candidate))
+      supported.push_back(candidate);
+  return supported;
+}
+
+const ip::kernels& ip::active_kernels()
+{
+  auto active = selected_kernels.load(std::memory_order_acquire);
+  if (active == nullptr)
+  {
+    active = supported_kernels().back();
+    selected_kernels.store(active, std::memory_order_release);
+  }
+  return *active;
+}
+
+const ip::kernels& ip::find_kernels(const std::string& name)
+{
+  for (auto candidate : all_kernels)
+  {
+    if (name != candidate->name)
+      continue;
+    if (!cpu_supports(*candidate))
+      throw std::runtime_error("kernel " + name + " is not supported by this CPU");
+    return *candidate;
+  }
+  throw std::invalid_argument("unknown kernel: " + name);
+}
+
+void ip::select_kernels(const std::string& name)
+{
+  selected_kernels.store(&find_kernels(name), std::memory_order_release);
+}
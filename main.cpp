@@ -1,8 +1,177 @@
 #include "ip_filter.h"
+#include "ingest.h"
+#include "output.h"
+#include "dispatch.h"
+#include "expression.h"
+#include "sketch.h"
+#include "enrich.h"
+#include "histogram.h"
 
 #include <iostream>
 #include <iomanip>
 #include <string>
+#include <vector>
+#include <memory>
+
+template<size_t Width>
+void process(
+    const std::vector<ip::basic_pool<Width>>& runs
+    , const std::vector<ip::expression<Width>>& queries
+    , std::ostream& output
+    , ip::output_format format
+    , const ip::range_table<Width>* table
+    )
+{
+  // queries run during the merge, block by block; the first one streams out,
+  // the others are collected and follow it
+  auto streamed = ip::encoder<Width>(output, format);
+  auto labelled = std::unique_ptr<typename ip::range_table<Width>::cursor>(table ? new typename ip::range_table<Width>::cursor(*table) : nullptr);
+  auto collected = std::vector<ip::basic_pool<Width>>(queries.size());
+
+  auto block = ip::basic_pool<Width>();
+  ip::byte_t matches[ip::expression<Width>::block_size];
+  auto flush = [&]()
+  {
+    for (size_t query = 0; query < queries.size(); ++query)
+    {
+      queries[query].evaluate(block.data(), block.size(), matches);
+      for (size_t i = 0; i < block.size(); ++i)
+      {
+	if (!matches[i])
+	  continue;
+	if (query == 0 && labelled)
+	{
+	  auto label = labelled->next(block[i]);
+	  ip::print(output, block[i]);
+	  output << '\t';
+	  if (label)
+	    output << *label;
+	  output << '\n';
+	}
+	else if (query == 0)
+	  streamed.push(block[i]);
+	else
+	  collected[query].push_back(block[i]);
+      }
+    }
+    block.clear();
+  };
+
+  ip::merge(runs, [&](const ip::basic_addr<Width>& addr)
+      {
+	block.push_back(addr);
+	if (block.size() == ip::expression<Width>::block_size)
+	  flush();
+      });
+  flush();
+  streamed.finish();
+
+  for (size_t query = 1; query < queries.size(); ++query)
+  {
+    if (table)
+      ip::print(output, collected[query], table->join(collected[query]));
+    else
+      ip::print(output, collected[query], format);
+  }
+}
+
+template<size_t Width>
+void count(
+    const std::vector<ip::basic_pool<Width>>& runs
+    , const ip::histogram<Width>& counts
+    , const std::vector<ip::expression<Width>>& queries
+    , std::ostream& output
+    )
+{
+  // one count per query; prefixes of up to 16 bits, single octets and "any"
+  // come from the histogram, anything else scans the unsorted runs in place
+  for (const auto& query : queries)
+  {
+    ip::key_t<Width> mask, value;
+    ip::byte_t byte;
+    size_t result = 0;
+    auto answered = query.as_mask(mask, value) && counts.try_count(mask, value, result);
+    if (!answered && query.as_any(byte))
+    {
+      result = counts.count_any(byte);
+      answered = true;
+    }
+    if (!answered)
+      for (const auto& run : runs)
+	result += query.count(run);
+    output << result << '\n';
+  }
+}
+
+template<size_t Width>
+void process(
+    const std::vector<std::string>& inputs
+    , const std::vector<std::string>& expressions
+    , std::ostream& output
+    , ip::output_format format
+    , const std::string& ranges
+    , bool count_only
+    )
+{
+  auto table = std::unique_ptr<ip::range_table<Width>>();
+  if (!ranges.empty())
+  {
+    if (format != ip::output_format::text)
+      throw std::invalid_argument("--enrich needs the text format");
+    table.reset(new ip::range_table<Width>(ip::read_range_table<Width>(ranges)));
+  }
+
+  auto queries = std::vector<ip::expression<Width>>();
+  for (const auto& text : expressions)
+    queries.emplace_back(text);
+
+  // counting needs no order: the histograms are built as the files load
+  // and the runs are never sorted
+  auto runs = std::vector<ip::basic_pool<Width>>();
+  if (count_only)
+  {
+    auto counts = ip::histogram<Width>();
+    if (inputs.empty())
+    {
+      runs.push_back(ip::read<Width>(std::cin));
+      counts.add(runs.back());
+    }
+    else
+    {
+      counts = ip::histogram_files<Width>(ip::expand_paths(inputs), runs);
+    }
+    count(runs, counts, queries, output);
+    return;
+  }
+
+  if (inputs.empty())
+  {
+    runs.push_back(ip::read<Width>(std::cin));
+    ip::sort(runs.back());
+  }
+  else
+  {
+    runs = ip::read_sorted<Width>(ip::expand_paths(inputs));
+  }
+  process(runs, queries, output, format, table.get());
+}
+
+template<size_t Width>
+void summarize(
+    const std::vector<std::string>& inputs
+    , const typename ip::traffic_sketch<Width>::options& opts
+    , size_t top_k
+    , std::ostream& output
+    )
+{
+  // fixed memory, the addresses are never kept
+  auto sketch = ip::traffic_sketch<Width>(opts);
+  if (inputs.empty())
+    ip::sketch_stream(std::cin, sketch);
+  else
+    sketch = ip::sketch_files<Width>(ip::expand_paths(inputs), opts);
+  ip::print(output, sketch, top_k);
+}
 
 int main(int argc, char const *argv[])
 {
@@ -10,37 +179,76 @@ int main(int argc, char const *argv[])
   {
     std::ios::sync_with_stdio(false);
 
-    auto ip_pool = ipv4::pool_t();;
+    bool ipv6 = false;
+    auto format = ip::output_format::text;
+    auto inputs = std::vector<std::string>(); // files or glob patterns, stdin if none
+    auto expressions = std::vector<std::string>();
+    auto ranges = std::string(); // range table to label the output with
+    bool sketch = false;
+    bool count_only = false;
+    size_t top_k = 10;
+    unsigned prefix_length = 16;
+    for (int i = 1; i < argc; ++i)
+    {
+      auto arg = std::string(argv[i]);
+      if (arg == "-6" || arg == "--ipv6")
+	ipv6 = true;
+      else if (arg == "-4" || arg == "--ipv4")
+	ipv6 = false;
+      else if (arg == "-e" && i + 1 < argc)
+	expressions.push_back(argv[++i]);
+      else if (arg.compare(0, 7, "--expr=") == 0)
+	expressions.push_back(arg.substr(7));
+      else if (arg == "--count")
+	count_only = true;
+      else if (arg == "--sketch")
+	sketch = true;
+      else if (arg.compare(0, 6, "--top=") == 0)
+	top_k = std::stoul(arg.substr(6));
+      else if (arg.compare(0, 9, "--prefix=") == 0)
+	prefix_length = static_cast<unsigned>(std::stoul(arg.substr(9)));
+      else if (arg.compare(0, 9, "--enrich=") == 0)
+	ranges = arg.substr(9);
+      else if (arg.compare(0, 9, "--kernel=") == 0)
+	ip::select_kernels(arg.substr(9));
+      else if (arg.compare(0, 9, "--format=") == 0)
+	format = ip::to_output_format(arg.substr(9));
+      else if (!arg.empty() && arg.front() == '-')
+	throw std::invalid_argument("unknown option: " + arg);
+      else
+	inputs.push_back(arg);
+    }
 
-    for(std::string line; !std::cin.eof();)
+    if (sketch)
     {
-      std::cin >> line;
-      if (std::cin.good())
+      if (ipv6)
       {
-	std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-	ip_pool.emplace_back(ipv4::to_addr(line));
+	auto opts = ip::traffic_sketch<ipv6::width>::default_options();
+	opts.prefix_length = prefix_length;
+	summarize<ipv6::width>(inputs, opts, top_k, std::cout);
       }
+      else
+      {
+	auto opts = ip::traffic_sketch<ipv4::width>::default_options();
+	opts.prefix_length = prefix_length;
+	summarize<ipv4::width>(inputs, opts, top_k, std::cout);
+      }
+      return 0;
     }
 
-    // for(std::string line; std::getline(std::cin, line);)
-    //   ip_pool.emplace_back(ipv4::to_addr(ipv4::split(line, '\t').at(0)));
-
-    ipv4::sort(ip_pool);
-    ipv4::print(std::cout, ip_pool);
-
-    auto filtered_pool = ipv4::filter(ip_pool, 1);
-    ipv4::print(std::cout, filtered_pool);
-
-    filtered_pool = ipv4::filter(ip_pool, 46, 70);
-    ipv4::print(std::cout, filtered_pool);
-
-    filtered_pool = ipv4::filter_any(ip_pool, 46);
-    ipv4::print(std::cout, filtered_pool);
+    // the whole sorted pool followed by the classic queries, unless asked otherwise
+    if (expressions.empty())
+      expressions = {"all", "o1=1", "o1=46 and o2=70", "any=46"};
 
+    if (ipv6)
+      process<ipv6::width>(inputs, expressions, std::cout, format, ranges, count_only);
+    else
+      process<ipv4::width>(inputs, expressions, std::cout, format, ranges, count_only);
   }
   catch(const std::exception &e)
   {
     std::cerr << e.what() << std::endl;
+    return 1;
   }
 
   return 0;
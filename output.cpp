@@ -0,0 +1,195 @@
+#include "output.h"
+
+#include <stdexcept>
+
+namespace
+{
+  const char binary_magic[] = {'I', 'P', 'B', 'N'};
+  const ip::byte_t binary_version = 2; // 1 had no chunks
+  const size_t text_batch_size = 1024;
+
+  unsigned trailing_ones(uint32_t key)
+  {
+    return (~key == 0) ? 32 : static_cast<unsigned>(__builtin_ctz(~key));
+  }
+
+  unsigned trailing_ones(ip::uint128_t key)
+  {
+    auto low = static_cast<uint64_t>(key);
+    if (~low != 0)
+      return static_cast<unsigned>(__builtin_ctzll(~low));
+    auto high = static_cast<uint64_t>(key >> 64);
+    return 64 + ((~high == 0) ? 64 : static_cast<unsigned>(__builtin_ctzll(~high)));
+  }
+
+  template<typename Key>
+  Key low_mask(unsigned bits)
+  {
+    return (bits >= sizeof(Key) * 8) ? static_cast<Key>(~Key()) : static_cast<Key>((Key(1) << bits) - 1);
+  }
+}
+
+ip::output_format ip::to_output_format(const std::string& name)
+{
+  if (name == "text")
+    return output_format::text;
+  if (name == "cidr")
+    return output_format::cidr;
+  if (name == "range")
+    return output_format::range;
+  if (name == "binary")
+    return output_format::binary;
+  throw std::invalid_argument("unknown output format: " + name);
+}
+
+template<size_t Width>
+ip::encoder<Width>::encoder(std::ostream& stream, output_format format)
+  : stream(stream), format(format), pending(false), run_first(), run_last(), buffered()
+{
+}
+
+template<size_t Width>
+void ip::encoder<Width>::push(const basic_addr<Width>& addr)
+{
+  switch (format)
+  {
+    case output_format::text:
+      // batches go through the pool printer, which has the fast IPv4 formatter
+      buffered.push_back(addr);
+      if (buffered.size() == text_batch_size)
+      {
+	print(stream, buffered);
+	buffered.clear();
+      }
+      break;
+
+    case output_format::binary:
+      buffered.push_back(addr);
+      if (buffered.size() == binary_chunk_size)
+      {
+	write_binary(stream, buffered.data(), buffered.size(), true);
+	buffered.clear();
+      }
+      break;
+
+    case output_format::cidr:
+    case output_format::range:
+    {
+      auto key = to_key(addr);
+      if (pending && (key == run_first || (key < run_first && key + 1 == run_first)))
+      {
+	run_first = key; // duplicates and the next lower neighbour extend the run
+	break;
+      }
+      if (pending)
+	emit(run_first, run_last);
+      pending = true;
+      run_first = run_last = key;
+      break;
+    }
+  }
+}
+
+template<size_t Width>
+void ip::encoder<Width>::finish()
+{
+  if (pending)
+  {
+    emit(run_first, run_last);
+    pending = false;
+  }
+
+  if (format == output_format::text)
+  {
+    print(stream, buffered);
+    buffered.clear();
+  }
+
+  if (format == output_format::binary)
+  {
+    write_binary(stream, buffered.data(), buffered.size());
+    buffered.clear();
+  }
+}
+
+template<size_t Width>
+void ip::encoder<Width>::emit(key_t<Width> first, key_t<Width> last)
+{
+  if (format == output_format::range)
+  {
+    print(stream, from_key<Width>(first));
+    stream << '-';
+    print(stream, from_key<Width>(last));
+    stream << '\n';
+    return;
+  }
+
+  // minimal prefix cover, largest aligned block ending at the top of what is left first
+  const auto key_bits = static_cast<unsigned>(Width * 8);
+  for (;;)
+  {
+    auto span = static_cast<key_t<Width>>(last - first);
+    auto bits = std::min(trailing_ones(last), key_bits);
+    while (low_mask<key_t<Width>>(bits) > span)
+      --bits;
+
+    auto block_first = static_cast<key_t<Width>>(last - low_mask<key_t<Width>>(bits));
+    print(stream, from_key<Width>(block_first));
+    stream << '/' << (key_bits - bits) << '\n';
+
+    if (block_first == first)
+      break;
+    last = static_cast<key_t<Width>>(block_first - 1);
+  }
+}
+
+template<size_t Width>
+void ip::write_binary(std::ostream& stream, const basic_addr<Width>* first, size_t n, bool more)
+{
+  char header[binary_header_size] = {};
+  std::copy(std::begin(binary_magic), std::end(binary_magic), header);
+  header[4] = static_cast<char>(binary_version);
+  header[5] = static_cast<char>(Width);
+  header[6] = static_cast<char>(more ? binary_more_chunks : 0);
+  for (size_t i = 0; i < 8; ++i)
+    header[8 + i] = static_cast<char>(static_cast<uint64_t>(n) >> (8 * i));
+
+  stream.write(header, sizeof(header));
+  static_assert(sizeof(basic_addr<Width>) == Width, "addresses must be packed");
+  stream.write(reinterpret_cast<const char*>(first), static_cast<std::streamsize>(n * Width));
+}
+
+template<size_t Width>
+ip::basic_pool<Width> ip::read_binary(std::istream& stream)
+{
+  auto ip_pool = basic_pool<Width>();
+  for (bool more = true; more;)
+  {
+    char header[binary_header_size] = {};
+    stream.read(header, sizeof(header));
+    const auto version = static_cast<byte_t>(header[4]);
+    if (!stream
+      || !std::equal(std::begin(binary_magic), std::end(binary_magic), header)
+      || version < 1 || version > binary_version
+      || static_cast<byte_t>(header[5]) != Width)
+      throw std::runtime_error("binary input: bad header");
+    more = (version > 1 && (static_cast<byte_t>(header[6]) & binary_more_chunks) != 0);
+
+    uint64_t count = 0;
+    for (size_t i = 0; i < 8; ++i)
+      count |= static_cast<uint64_t>(static_cast<byte_t>(header[8 + i])) << (8 * i);
+
+    for (basic_addr<Width> addr; count > 0 && stream.read(reinterpret_cast<char*>(addr.data()), Width); --count)
+      ip_pool.push_back(addr);
+    if (count != 0)
+      throw std::runtime_error("binary input: truncated data");
+  }
+  return ip_pool;
+}
+
+template class ip::encoder<4>;
+template class ip::encoder<16>;
+template void ip::write_binary<4>(std::ostream&, const basic_addr<4>*, size_t, bool);
+template void ip::write_binary<16>(std::ostream&, const basic_addr<16>*, size_t, bool);
+template ip::basic_pool<4> ip::read_binary<4>(std::istream&);
+template ip::basic_pool<16> ip::read_binary<16>(std::istream&);
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "ip_filter.h"
+
+#include <string>
+#include <vector>
+#include <iostream>
+
+namespace ip
+{
+
+  enum class output_format
+  {
+    text,   //! one address per line
+    cidr,   //! runs of consecutive addresses as minimal prefix blocks, "a.b.c.d/len"
+    range,  //! runs of consecutive addresses as "start-end"
+    binary  //! header followed by packed addresses in network byte order
+  };
+
+  output_format to_output_format(const std::string& name);
+
+  //! binary header: "IPBN", version, address width, flags, a reserved byte,
+  //! little-endian 64-bit count
+  //!
+  //! a section is written as one chunk when its size is known up front, as
+  //! print() does; the streaming encoder writes chunks of binary_chunk_size
+  //! addresses instead, flagged with binary_more_chunks but the last, so it
+  //! never holds more than a chunk and works on pipes, where the count cannot
+  //! be patched afterwards
+  constexpr size_t binary_header_size = 16;
+  constexpr size_t binary_chunk_size = 1 << 16;
+  constexpr byte_t binary_more_chunks = 1;
+
+  //! writes addresses [first, first + n) as a chunk of a binary section
+  template<size_t Width>
+  void write_binary(std::ostream& stream, const basic_addr<Width>* first, size_t n, bool more = false);
+
+  //! streaming encoder; cidr and range expect addresses in the descending order of sort()
+  //! and emit blocks in that order, other orders just produce more blocks
+  template<size_t Width>
+  class encoder
+  {
+    public:
+      encoder(std::ostream& stream, output_format format);
+
+      void push(const basic_addr<Width>& addr);
+
+      //! flushes the pending run, or the last binary chunk
+      void finish();
+
+    private:
+      void emit(key_t<Width> first, key_t<Width> last);
+
+      std::ostream& stream;
+      output_format format;
+      bool pending;
+      key_t<Width> run_first;
+      key_t<Width> run_last;
+      basic_pool<Width> buffered; // text batch or binary chunk
+  };
+
+  template<size_t Width, typename Allocator>
+  void print(std::ostream& stream, const basic_pool<Width, Allocator>& ip_pool, output_format format)
+  {
+    if (format == output_format::binary)
+    {
+      write_binary(stream, ip_pool.data(), ip_pool.size());
+      return;
+    }
+
+    auto output = encoder<Width>(stream, format);
+    for (const auto& addr : ip_pool)
+      output.push(addr);
+    output.finish();
+  }
+
+  //! reads one binary section, joining its chunks
+  template<size_t Width>
+  basic_pool<Width> read_binary(std::istream& stream);
+}
@@ -0,0 +1,346 @@
+#include "sketch.h"
+#include "ingest.h"
+#include "text.h"
+
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+
+namespace
+{
+  // leaves weight as it is unless all of [first, last) is a decimal that fits
+  void parse_weight(const char* first, const char* last, uint64_t& weight)
+  {
+    uint64_t value = 0;
+    for (; first != last; ++first)
+    {
+      if (*first < '0' || *first > '9')
+	return;
+      const auto digit = static_cast<uint64_t>(*first - '0');
+      if (value > (std::numeric_limits<uint64_t>::max() - digit) / 10)
+	return;
+      value = value * 10 + digit;
+    }
+    weight = value;
+  }
+
+  template<size_t Width>
+  bool less_count(const typename ip::space_saving<Width>::counter& lhs, const typename ip::space_saving<Width>::counter& rhs)
+  {
+    return (lhs.count < rhs.count);
+  }
+}
+
+ip::hyperloglog::hyperloglog(unsigned precision)
+  : precision(precision), registers()
+{
+  if (precision < 4 || precision > 18)
+    throw std::invalid_argument("hyperloglog precision must be in 4..18");
+  registers.assign(size_t(1) << precision, 0);
+}
+
+double ip::hyperloglog::estimate() const
+{
+  const auto m = static_cast<double>(registers.size());
+  double alpha = 0.7213 / (1.0 + 1.079 / m);
+  if (registers.size() == 16)
+    alpha = 0.673;
+  else if (registers.size() == 32)
+    alpha = 0.697;
+  else if (registers.size() == 64)
+    alpha = 0.709;
+
+  double sum = 0.0;
+  size_t zeros = 0;
+  for (auto rank : registers)
+  {
+    sum += std::ldexp(1.0, -static_cast<int>(rank));
+    zeros += (rank == 0);
+  }
+
+  auto estimate = alpha * m * m / sum;
+  // small range correction; 64-bit hashes need no large range one
+  if (estimate <= 2.5 * m && zeros != 0)
+    estimate = m * std::log(m / static_cast<double>(zeros));
+  return estimate;
+}
+
+void ip::hyperloglog::merge(const hyperloglog& other)
+{
+  if (other.precision != precision)
+    throw std::invalid_argument("hyperloglog precisions differ");
+  for (size_t i = 0; i < registers.size(); ++i)
+    registers[i] = std::max(registers[i], other.registers[i]);
+}
+
+template<size_t Width>
+ip::space_saving<Width>::space_saving(size_t capacity)
+  : capacity(capacity), heap(), positions()
+{
+  if (capacity == 0)
+    throw std::invalid_argument("space_saving capacity must be positive");
+  heap.reserve(capacity);
+  positions.reserve(capacity);
+}
+
+template<size_t Width>
+bool ip::space_saving<Width>::add(const basic_addr<Width>& addr, uint64_t weight, basic_addr<Width>& evicted)
+{
+  const auto key = to_key(addr);
+  auto found = positions.find(key);
+  if (found != positions.end())
+  {
+    heap[found->second].count += weight;
+    sift_down(found->second);
+    return false;
+  }
+
+  if (heap.size() < capacity)
+  {
+    heap.push_back(counter{addr, weight, 0});
+    auto position = heap.size() - 1;
+    while (position > 0 && heap[position].count < heap[(position - 1) / 2].count)
+    {
+      auto parent = (position - 1) / 2;
+      std::swap(heap[position], heap[parent]);
+      positions[to_key(heap[position].addr)] = position;
+      position = parent;
+    }
+    positions[key] = position;
+    return false;
+  }
+
+  // the minimum counter is taken over, its count becomes the error bound
+  auto& root = heap.front();
+  evicted = root.addr;
+  positions.erase(to_key(root.addr));
+  root = counter{addr, root.count + weight, root.count};
+  positions[key] = 0;
+  sift_down(0);
+  return true;
+}
+
+template<size_t Width>
+uint64_t ip::space_saving<Width>::floor() const
+{
+  return (heap.size() < capacity) ? 0 : heap.front().count;
+}
+
+template<size_t Width>
+void ip::space_saving<Width>::sift_down(size_t position)
+{
+  for (;;)
+  {
+    auto smallest = position;
+    for (auto child = 2 * position + 1; child <= 2 * position + 2 && child < heap.size(); ++child)
+      if (heap[child].count < heap[smallest].count)
+	smallest = child;
+    if (smallest == position)
+      break;
+
+    std::swap(heap[position], heap[smallest]);
+    positions[to_key(heap[position].addr)] = position;
+    positions[to_key(heap[smallest].addr)] = smallest;
+    position = smallest;
+  }
+}
+
+template<size_t Width>
+void ip::space_saving<Width>::rebuild()
+{
+  std::make_heap(heap.begin(), heap.end()
+      , [](const counter& lhs, const counter& rhs) {return less_count<Width>(rhs, lhs);});
+  positions.clear();
+  for (size_t position = 0; position < heap.size(); ++position)
+    positions[to_key(heap[position].addr)] = position;
+}
+
+template<size_t Width>
+void ip::space_saving<Width>::merge(const space_saving& other)
+{
+  const auto own_floor = floor();
+  const auto other_floor = other.floor();
+
+  auto combined = std::unordered_map<key_t<Width>, counter, key_hash>();
+  for (const auto& c : heap)
+    combined.emplace(to_key(c.addr), counter{c.addr, c.count + other_floor, c.error + other_floor});
+  for (const auto& c : other.heap)
+  {
+    auto inserted = combined.emplace(to_key(c.addr), counter{c.addr, c.count + own_floor, c.error + own_floor});
+    if (!inserted.second)
+    {
+      inserted.first->second.count += c.count - other_floor;
+      inserted.first->second.error += c.error - other_floor;
+    }
+  }
+
+  heap.clear();
+  for (const auto& entry : combined)
+    heap.push_back(entry.second);
+  if (heap.size() > capacity)
+  {
+    std::nth_element(heap.begin(), heap.begin() + static_cast<std::ptrdiff_t>(capacity), heap.end()
+	, [](const counter& lhs, const counter& rhs) {return less_count<Width>(rhs, lhs);});
+    heap.resize(capacity);
+  }
+  rebuild();
+}
+
+template<size_t Width>
+std::vector<typename ip::space_saving<Width>::counter> ip::space_saving<Width>::top(size_t k) const
+{
+  auto counters = heap;
+  std::sort(counters.begin(), counters.end()
+      , [](const counter& lhs, const counter& rhs)
+	{
+	  return (lhs.count != rhs.count) ? lhs.count > rhs.count : lhs.addr > rhs.addr;
+	}
+      );
+  if (counters.size() > k)
+    counters.resize(k);
+  return counters;
+}
+
+template<size_t Width>
+ip::traffic_sketch<Width>::traffic_sketch(const options& opts)
+  : opts(opts), talkers(opts.top_capacity), total(opts.precision), busiest(opts.prefix_capacity), prefixes()
+{
+  if (opts.prefix_length > Width * 8)
+    throw std::invalid_argument("prefix length exceeds the address width");
+  hyperloglog(opts.prefix_precision); // validates it before the first address
+}
+
+template<size_t Width>
+void ip::traffic_sketch<Width>::add(const basic_addr<Width>& addr, uint64_t weight)
+{
+  const auto h = hash(addr);
+  total.add(h);
+  talkers.add(addr, weight);
+
+  const auto prefix = static_cast<key_t<Width>>(to_key(addr) & prefix_mask<Width>(opts.prefix_length));
+  basic_addr<Width> evicted;
+  if (busiest.add(from_key<Width>(prefix), weight, evicted))
+    prefixes.erase(to_key(evicted));
+
+  auto found = prefixes.find(prefix);
+  if (found == prefixes.end())
+    found = prefixes.emplace(prefix, hyperloglog(opts.prefix_precision)).first;
+  found->second.add(h);
+}
+
+template<size_t Width>
+void ip::traffic_sketch<Width>::merge(const traffic_sketch& other)
+{
+  if (other.opts.prefix_length != opts.prefix_length)
+    throw std::invalid_argument("traffic sketches of different prefix lengths");
+
+  talkers.merge(other.talkers);
+  total.merge(other.total);
+  busiest.merge(other.busiest);
+  for (const auto& entry : other.prefixes)
+  {
+    auto inserted = prefixes.emplace(entry);
+    if (!inserted.second)
+      inserted.first->second.merge(entry.second);
+  }
+
+  // the counters of prefixes that fell out of the merged summary go
+  for (auto entry = prefixes.begin(); entry != prefixes.end();)
+  {
+    if (busiest.contains(from_key<Width>(entry->first)))
+      ++entry;
+    else
+      entry = prefixes.erase(entry);
+  }
+}
+
+template<size_t Width>
+std::vector<std::pair<ip::basic_addr<Width>, double>> ip::traffic_sketch<Width>::distinct_per_prefix() const
+{
+  auto result = std::vector<std::pair<basic_addr<Width>, double>>();
+  result.reserve(prefixes.size());
+  for (const auto& entry : prefixes)
+    result.emplace_back(from_key<Width>(entry.first), entry.second.estimate());
+  return result;
+}
+
+template<size_t Width>
+void ip::sketch_stream(std::istream& stream, traffic_sketch<Width>& sketch, size_t weight_column)
+{
+  for (std::string line; std::getline(stream, line);)
+  {
+    auto first = line.data();
+    auto last = line.data() + line.size();
+
+    auto field = std::find_if_not(first, last, is_space);
+    auto field_end = std::find_if(field, last, is_space);
+    auto addr = basic_addr<Width>();
+    if (field == field_end || !try_parse<Width>(field, field_end, addr))
+      continue;
+
+    uint64_t weight = 1;
+    for (size_t column = 2; column <= weight_column && field_end != last; ++column)
+    {
+      field = std::find_if_not(field_end, last, is_space);
+      field_end = std::find_if(field, last, is_space);
+      if (column == weight_column && field != field_end)
+	parse_weight(field, field_end, weight);
+    }
+
+    sketch.add(addr, weight);
+  }
+}
+
+template<size_t Width>
+ip::traffic_sketch<Width> ip::sketch_files(
+    const std::vector<std::string>& paths
+    , const typename traffic_sketch<Width>::options& opts
+    , size_t weight_column
+    , size_t threads
+    )
+{
+  auto sketches = std::vector<traffic_sketch<Width>>(file_workers(paths.size(), threads), traffic_sketch<Width>(opts));
+  for_each_file(paths, threads, [&](size_t worker, size_t file)
+      {
+	std::ifstream stream(paths[file]);
+	if (!stream.is_open())
+	  throw std::runtime_error("cannot open " + paths[file]);
+	sketch_stream(stream, sketches[worker], weight_column);
+      });
+
+  for (size_t i = 1; i < sketches.size(); ++i)
+    sketches.front().merge(sketches[i]);
+  return sketches.front();
+}
+
+template<size_t Width>
+void ip::print(std::ostream& stream, const traffic_sketch<Width>& sketch, size_t top_k)
+{
+  // "addr<TAB>count<TAB>error" of the top talkers, then "prefix/len<TAB>distinct",
+  // the whole address space first
+  for (const auto& c : sketch.top(top_k))
+  {
+    print(stream, c.addr);
+    stream << '\t' << c.count << '\t' << c.error << '\n';
+  }
+
+  print(stream, basic_addr<Width>());
+  stream << "/0\t" << std::llround(sketch.distinct()) << '\n';
+  for (const auto& entry : sketch.distinct_per_prefix())
+  {
+    print(stream, entry.first);
+    stream << '/' << sketch.prefix_length() << '\t' << std::llround(entry.second) << '\n';
+  }
+}
+
+template class ip::space_saving<4>;
+template class ip::space_saving<16>;
+template class ip::traffic_sketch<4>;
+template class ip::traffic_sketch<16>;
+template void ip::sketch_stream<4>(std::istream&, traffic_sketch<4>&, size_t);
+template void ip::sketch_stream<16>(std::istream&, traffic_sketch<16>&, size_t);
+template ip::traffic_sketch<4> ip::sketch_files<4>(const std::vector<std::string>&, const traffic_sketch<4>::options&, size_t, size_t);
+template ip::traffic_sketch<16> ip::sketch_files<16>(const std::vector<std::string>&, const traffic_sketch<16>::options&, size_t, size_t);
+template void ip::print<4>(std::ostream&, const traffic_sketch<4>&, size_t);
+template void ip::print<16>(std::ostream&, const traffic_sketch<16>&, size_t);
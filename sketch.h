@@ -0,0 +1,185 @@
+#pragma once
+
+#include "ip_filter.h"
+
+#include <map>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <unordered_map>
+
+namespace ip
+{
+
+  //! HyperLogLog distinct counter with 2^precision one-byte registers
+  class hyperloglog
+  {
+    public:
+      explicit hyperloglog(unsigned precision = 12);
+
+      void add(uint64_t hash)
+      {
+	auto index = static_cast<size_t>(hash >> (64 - precision));
+	auto rest = hash << precision;
+	auto rank = static_cast<byte_t>(rest == 0 ? 64 - precision + 1 : __builtin_clzll(rest) + 1);
+	if (rank > registers[index])
+	  registers[index] = rank;
+      }
+
+      double estimate() const;
+
+      //! both sides must have the same precision
+      void merge(const hyperloglog& other);
+
+      size_t size_in_bytes() const
+      {
+	return registers.size();
+      }
+
+    private:
+      unsigned precision;
+      std::vector<byte_t> registers;
+  };
+
+  //! space-saving heavy hitters: at most capacity counters, every count is an
+  //! overestimate by no more than its error
+  template<size_t Width>
+  class space_saving
+  {
+    public:
+      struct counter
+      {
+	basic_addr<Width> addr;
+	uint64_t count;
+	uint64_t error;
+      };
+
+      explicit space_saving(size_t capacity);
+
+      void add(const basic_addr<Width>& addr, uint64_t weight = 1)
+      {
+	basic_addr<Width> evicted;
+	add(addr, weight, evicted);
+      }
+
+      //! returns true when addr took over the counter of evicted
+      bool add(const basic_addr<Width>& addr, uint64_t weight, basic_addr<Width>& evicted);
+
+      bool contains(const basic_addr<Width>& addr) const
+      {
+	return (positions.count(to_key(addr)) != 0);
+      }
+
+      //! mergeable summaries: an address missing on one side counts as that
+      //! side's minimum, then the greatest counters are kept
+      void merge(const space_saving& other);
+
+      //! counters by descending count
+      std::vector<counter> top(size_t k) const;
+
+    private:
+      struct key_hash
+      {
+	size_t operator()(const key_t<Width>& key) const
+	{
+	  return static_cast<size_t>(hash_key(key));
+	}
+      };
+
+      uint64_t floor() const;
+      void sift_down(size_t position);
+      void rebuild();
+
+      size_t capacity;
+      std::vector<counter> heap;	//! min-heap by count
+      std::unordered_map<key_t<Width>, size_t, key_hash> positions;
+  };
+
+  //! fixed memory traffic summary: top talkers, distinct addresses overall
+  //! and per prefix
+  //!
+  //! distinct counters are kept for the prefix_capacity busiest prefixes only,
+  //! tracked with a space-saving summary of their own; a prefix that takes
+  //! over the slot of an evicted one starts a fresh counter, so its estimate
+  //! covers the addresses seen since; memory stays within
+  //! prefix_capacity * 2^prefix_precision bytes of counters whatever the length
+  template<size_t Width>
+  class traffic_sketch
+  {
+    public:
+      using counter = typename space_saving<Width>::counter;
+
+      struct options
+      {
+	size_t top_capacity;
+	unsigned prefix_length;
+	unsigned precision;		//! of the overall distinct counter
+	unsigned prefix_precision;	//! of every per prefix distinct counter
+	size_t prefix_capacity;		//! prefixes with a distinct counter
+      };
+
+      static options default_options()
+      {
+	return options{1024, 16, 14, 10, 1024};
+      }
+
+      explicit traffic_sketch(const options& opts = default_options());
+
+      void add(const basic_addr<Width>& addr, uint64_t weight = 1);
+
+      void merge(const traffic_sketch& other);
+
+      std::vector<counter> top(size_t k) const
+      {
+	return talkers.top(k);
+      }
+
+      double distinct() const
+      {
+	return total.estimate();
+      }
+
+      //! distinct estimates of the tracked prefixes, in ascending prefix order
+      std::vector<std::pair<basic_addr<Width>, double>> distinct_per_prefix() const;
+
+      unsigned prefix_length() const
+      {
+	return opts.prefix_length;
+      }
+
+    private:
+      options opts;
+      space_saving<Width> talkers;
+      hyperloglog total;
+      space_saving<Width> busiest;		//! traffic by prefix
+      std::map<key_t<Width>, hyperloglog> prefixes;	//! one per prefix tracked by busiest
+  };
+
+  //! feeds the first field of every line, weighted by the given 1-based
+  //! column (1 when absent or not a number), without keeping the lines;
+  //! malformed addresses are skipped as in read()
+  template<size_t Width>
+  void sketch_stream(std::istream& stream, traffic_sketch<Width>& sketch, size_t weight_column = 2);
+
+  //! one sketch per worker thread, merged at the end
+  template<size_t Width>
+  traffic_sketch<Width> sketch_files(
+      const std::vector<std::string>& paths
+      , const typename traffic_sketch<Width>::options& opts
+      , size_t weight_column = 2
+      , size_t threads = 0
+      );
+
+  template<size_t Width>
+  void print(std::ostream& stream, const traffic_sketch<Width>& sketch, size_t top_k);
+}
+
+namespace ipv4
+{
+  using traffic_sketch = ip::traffic_sketch<width>;
+}
+
+namespace ipv6
+{
+  using traffic_sketch = ip::traffic_sketch<width>;
+}
@@ -0,0 +1,150 @@
+#include "snapshot.h"
+#include "ingest.h"
+
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <thread>
+
+template<size_t Width>
+ip::snapshot<Width>::snapshot(basic_pool<Width> ip_pool, uint64_t generation)
+  : addresses(std::move(ip_pool)), offsets(), number(generation)
+{
+  // merged runs arrive sorted already
+  if (!std::is_sorted(std::begin(addresses), std::end(addresses), std::greater<basic_addr<Width>>()))
+    sort(addresses);
+
+  size_t offset = 0;
+  for (size_t i = 0; i < 256; ++i)
+  {
+    offsets[i] = offset;
+    const auto byte = static_cast<byte_t>(255 - i);
+    while (offset < addresses.size() && addresses[offset][0] == byte)
+      ++offset;
+  }
+  offsets[256] = offset;
+}
+
+template<size_t Width>
+bool ip::snapshot<Width>::contains(const basic_addr<Width>& addr) const
+{
+  const auto first = addresses.data() + offsets[255 - addr[0]];
+  const auto last = addresses.data() + offsets[256 - addr[0]];
+  return std::binary_search(first, last, addr, std::greater<basic_addr<Width>>());
+}
+
+template<size_t Width>
+std::pair<const ip::basic_addr<Width>*, const ip::basic_addr<Width>*> ip::snapshot<Width>::equal_range(const prefix<Width>& pfx) const
+{
+  const auto mask = to_key(pfx.mask);
+  const auto inverse = static_cast<key_t<Width>>(~mask);
+  if ((inverse & static_cast<key_t<Width>>(inverse + 1)) != 0)
+    throw std::invalid_argument("prefix mask must be made of leading bits");
+
+  // matches lie between the value and the value with every free bit set
+  const auto lowest = from_key<Width>(static_cast<key_t<Width>>(to_key(pfx.value) & mask));
+  const auto highest = from_key<Width>(static_cast<key_t<Width>>(to_key(pfx.value) | inverse));
+
+  auto first = addresses.data();
+  auto last = addresses.data() + addresses.size();
+  if (pfx.mask[0] == 0xff)
+  {
+    first = addresses.data() + offsets[255 - pfx.value[0]];
+    last = addresses.data() + offsets[256 - pfx.value[0]];
+  }
+  // none match when the value has bits outside the mask
+  if (lowest != pfx.value)
+    return std::make_pair(last, last);
+
+  first = std::lower_bound(first, last, highest, std::greater<basic_addr<Width>>());
+  last = std::upper_bound(first, last, lowest, std::greater<basic_addr<Width>>());
+  return std::make_pair(first, last);
+}
+
+template<size_t Width>
+ip::snapshot_holder<Width>::snapshot_holder(basic_pool<Width> ip_pool, size_t max_readers)
+  : current(nullptr), slots(std::max<size_t>(max_readers, 1)), writer(), retired(), generation(0)
+{
+  for (auto& slot : slots)
+    slot.pinned.store(nullptr);
+  current.store(new snapshot<Width>(std::move(ip_pool), generation));
+}
+
+template<size_t Width>
+ip::snapshot_holder<Width>::~snapshot_holder()
+{
+  delete current.load();
+}
+
+template<size_t Width>
+typename ip::snapshot_holder<Width>::guard ip::snapshot_holder<Width>::pin() const
+{
+  // start at a per-thread slot so that steady readers rarely contend; a
+  // single pass over the slots, so a reader never waits for another
+  const auto start = std::hash<std::thread::id>()(std::this_thread::get_id());
+  for (size_t i = 0; i < slots.size(); ++i)
+  {
+    auto& slot = slots[(start + i) % slots.size()].pinned;
+    auto pinned = current.load();
+    const snapshot<Width>* expected = nullptr;
+    if (slot.load(std::memory_order_relaxed) == nullptr && slot.compare_exchange_strong(expected, pinned))
+    {
+      // a writer that swapped in between may not have seen the announcement
+      for (auto now = current.load(); now != pinned; now = current.load())
+      {
+	pinned = now;
+	slot.store(pinned);
+      }
+      return guard(&slot, pinned);
+    }
+  }
+  throw std::runtime_error("all " + std::to_string(slots.size()) + " reader slots are pinned");
+}
+
+template<size_t Width>
+uint64_t ip::snapshot_holder<Width>::publish(basic_pool<Width> ip_pool)
+{
+  std::lock_guard<std::mutex> lock(writer);
+  auto fresh = new snapshot<Width>(std::move(ip_pool), ++generation);
+  retired.emplace_back(current.exchange(fresh));
+  collect();
+  return generation;
+}
+
+template<size_t Width>
+std::future<uint64_t> ip::snapshot_holder<Width>::reload(const std::vector<std::string>& paths)
+{
+  return std::async(std::launch::async, [this, paths]()
+      {
+	return publish(merge(read_sorted<Width>(expand_paths(paths))));
+      });
+}
+
+template<size_t Width>
+size_t ip::snapshot_holder<Width>::reclaim()
+{
+  std::lock_guard<std::mutex> lock(writer);
+  return collect();
+}
+
+template<size_t Width>
+bool ip::snapshot_holder<Width>::is_pinned(const snapshot<Width>* s) const
+{
+  return std::any_of(std::begin(slots), std::end(slots), [s](const slot_t& slot) {return slot.pinned.load() == s;});
+}
+
+template<size_t Width>
+size_t ip::snapshot_holder<Width>::collect()
+{
+  retired.erase(
+      std::remove_if(std::begin(retired), std::end(retired)
+	, [this](const std::unique_ptr<const snapshot<Width>>& s) {return !is_pinned(s.get());})
+      , std::end(retired)
+      );
+  return retired.size();
+}
+
+template class ip::snapshot<4>;
+template class ip::snapshot<16>;
+template class ip::snapshot_holder<4>;
+template class ip::snapshot_holder<16>;
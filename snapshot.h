@@ -0,0 +1,160 @@
+#pragma once
+
+#include "ip_filter.h"
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <future>
+
+namespace ip
+{
+
+  //! immutable sorted pool with a first byte index, published by snapshot_holder
+  template<size_t Width>
+  class snapshot
+  {
+    public:
+      //! sorts in the descending order of sort() and builds the index
+      snapshot(basic_pool<Width> ip_pool, uint64_t generation);
+
+      const basic_pool<Width>& pool() const
+      {
+	return addresses;
+      }
+
+      uint64_t generation() const
+      {
+	return number;
+      }
+
+      bool contains(const basic_addr<Width>& addr) const;
+
+      //! the contiguous run of addresses matching pfx, as [first, last);
+      //! throws std::invalid_argument unless the mask is made of leading bits
+      std::pair<const basic_addr<Width>*, const basic_addr<Width>*> equal_range(const prefix<Width>& pfx) const;
+
+      basic_pool<Width> filter_prefix(const prefix<Width>& pfx) const
+      {
+	auto range = equal_range(pfx);
+	return basic_pool<Width>(range.first, range.second);
+      }
+
+    private:
+      basic_pool<Width> addresses;
+      std::array<size_t, 257> offsets; //! run of first byte b is [offsets[255 - b], offsets[256 - b])
+      uint64_t number;
+  };
+
+  //! publishes snapshots to lock-free readers
+  //!
+  //! a reader pins the current snapshot by announcing it in one of the hazard
+  //! slots and checking that it is still current; a writer swaps the pointer
+  //! atomically and frees a retired snapshot only once no slot announces it, so
+  //! readers never block or wait on a reload, and the old pool is released on
+  //! the writer side, off the serving path
+  template<size_t Width>
+  class snapshot_holder
+  {
+    public:
+      //! keeps the snapshot pinned while alive, move only
+      class guard
+      {
+	public:
+	  guard(guard&& other) noexcept
+	    : slot(other.slot), current(other.current)
+	  {
+	    other.slot = nullptr;
+	  }
+
+	  guard(const guard&) = delete;
+	  guard& operator=(const guard&) = delete;
+	  guard& operator=(guard&&) = delete;
+
+	  ~guard()
+	  {
+	    if (slot)
+	      slot->store(nullptr, std::memory_order_release);
+	  }
+
+	  const snapshot<Width>& operator*() const
+	  {
+	    return *current;
+	  }
+
+	  const snapshot<Width>* operator->() const
+	  {
+	    return current;
+	  }
+
+	private:
+	  friend class snapshot_holder;
+
+	  guard(std::atomic<const snapshot<Width>*>* slot, const snapshot<Width>* current)
+	    : slot(slot), current(current)
+	  {
+	  }
+
+	  std::atomic<const snapshot<Width>*>* slot;
+	  const snapshot<Width>* current;
+      };
+
+      //! every live guard holds one of max_readers slots, nested pins on a
+      //! thread included
+      explicit snapshot_holder(basic_pool<Width> ip_pool = basic_pool<Width>(), size_t max_readers = 64);
+
+      //! no guard may outlive the holder
+      ~snapshot_holder();
+
+      snapshot_holder(const snapshot_holder&) = delete;
+      snapshot_holder& operator=(const snapshot_holder&) = delete;
+
+      //! lock-free: never waits on writers or other readers; throws
+      //! std::runtime_error instead of waiting when every slot is pinned
+      guard pin() const;
+
+      //! sorts and indexes ip_pool on the calling thread, swaps it in and
+      //! frees the retired snapshots that are no longer pinned; returns the
+      //! new generation
+      uint64_t publish(basic_pool<Width> ip_pool);
+
+      //! reads and merges the files on a background thread, then publishes;
+      //! the holder must outlive the future
+      std::future<uint64_t> reload(const std::vector<std::string>& paths);
+
+      //! frees retired snapshots whose last reader has left, returns how many remain
+      size_t reclaim();
+
+    private:
+      // one announcement per cache line
+      struct slot_t
+      {
+	std::atomic<const snapshot<Width>*> pinned;
+	char padding[64 - sizeof(std::atomic<const snapshot<Width>*>)];
+      };
+
+      bool is_pinned(const snapshot<Width>* s) const;
+      size_t collect(); // with the writer lock held
+
+      std::atomic<const snapshot<Width>*> current;
+      mutable std::vector<slot_t> slots;
+      std::mutex writer;
+      std::vector<std::unique_ptr<const snapshot<Width>>> retired;
+      uint64_t generation;
+  };
+}
+
+namespace ipv4
+{
+  using snapshot = ip::snapshot<width>;
+  using snapshot_holder = ip::snapshot_holder<width>;
+}
+
+namespace ipv6
+{
+  using snapshot = ip::snapshot<width>;
+  using snapshot_holder = ip::snapshot_holder<width>;
+}
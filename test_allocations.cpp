@@ -0,0 +1,110 @@
+#include "ip_filter.h"
+#include "ingest.h"
+#include "expression.h"
+#include "arena.h"
+
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+using namespace std::string_literals;
+
+// a test executable of its own, as the replaced global allocation functions
+// below count the heap use of everything linked in
+
+namespace
+{
+  std::atomic<size_t> heap_allocations(0);
+
+  void* counted_allocate(std::size_t size)
+  {
+    ++heap_allocations;
+    if (auto p = std::malloc(size ? size : 1))
+      return p;
+    throw std::bad_alloc();
+  }
+}
+
+void* operator new(std::size_t size)
+{
+  return counted_allocate(size);
+}
+
+void* operator new[](std::size_t size)
+{
+  return counted_allocate(size);
+}
+
+void operator delete(void* p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+  std::free(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept
+{
+  std::free(p);
+}
+
+#define BOOST_TEST_MODULE test_allocations
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(test_suite_allocations)
+
+  BOOST_AUTO_TEST_CASE(test_arena_pipeline_heap_free)
+  {
+    std::ifstream data("test_data.tsv");
+    std::ostringstream buffer;
+    buffer << data.rdbuf();
+    const auto text = buffer.str();
+    BOOST_REQUIRE(!text.empty());
+
+    // the library takes nothing from the heap behind the arena's back once
+    // the first reset has merged its chunks
+    ip::arena memory(4096);
+    const auto by_expression = ipv4::expression("o1=46 and o2=70 or any=46"s);
+    for (size_t round = 0; round < 3; ++round)
+    {
+      memory.reset();
+      const size_t before = heap_allocations;
+      size_t matches = 0;
+      {
+	auto ip_pool = ipv4::arena_pool(ip::arena_allocator<ipv4::addr_t>(memory));
+	ip::read<ipv4::width>(text.data(), text.data() + text.size(), ip_pool);
+	ipv4::sort(ip_pool);
+	matches = ipv4::filter(ip_pool, 46, 70).size() + ipv4::filter_any(ip_pool, 46).size();
+	matches += by_expression.filter(ip_pool).size();
+
+	auto v6_pool = ipv6::arena_pool(ip_pool.size(), ip::arena_allocator<ipv6::addr_t>(memory));
+	std::transform(ip_pool.begin(), ip_pool.end(), v6_pool.begin()
+	    , [](const ipv4::addr_t& addr) {return ipv6::addr_t{{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, addr[0], addr[1], addr[2], addr[3]}};});
+	ipv6::sort(v6_pool);
+	matches += ipv6::filter_any(v6_pool, 46).size();
+      }
+      const size_t after = heap_allocations;
+      BOOST_CHECK(matches > 0);
+      if (round > 0)
+	BOOST_CHECK_EQUAL(after - before, 0u);
+    }
+
+    // the counter does see heap pools
+    const size_t before = heap_allocations;
+    auto heap_pool = ipv4::pool_t();
+    ip::read<ipv4::width>(text.data(), text.data() + text.size(), heap_pool);
+    BOOST_CHECK(heap_allocations > before);
+  }
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -1,4 +1,14 @@
 #include "ip_filter.h"
+#include "bloom_filter.h"
+#include "ingest.h"
+#include "output.h"
+#include "dispatch.h"
+#include "expression.h"
+#include "sketch.h"
+#include "snapshot.h"
+#include "enrich.h"
+#include "arena.h"
+#include "histogram.h"
 
 #ifdef IP_FILTER_BENCH
 #  include "timer.h"
@@ -7,8 +17,17 @@
 #include <iostream>
 #include <iomanip>
 #include <fstream>
+#include <sstream>
 #include <functional>
 #include <algorithm>
+#include <random>
+#include <cstdio>
+#include <cmath>
+#include <map>
+#include <atomic>
+#include <thread>
+
+#include <sys/stat.h>
 
 using namespace std::string_literals;
 
@@ -422,6 +441,1027 @@ BOOST_AUTO_TEST_SUITE(test_suite_main)
     BOOST_CHECK(correct_pool == filtered_pool);
   }
 
+  BOOST_AUTO_TEST_CASE(test_ipv6_parse_and_format)
+  {
+    const std::vector<std::pair<std::string, std::string>> cases = {
+	  {"::"s,                                      "::"s}
+	, {"::1"s,                                     "::1"s}
+	, {"1::"s,                                     "1::"s}
+	, {"2001:0DB8:0000:0000:0000:0000:0000:0001"s, "2001:db8::1"s}
+	, {"2001:db8:0:0:1:0:0:1"s,                    "2001:db8::1:0:0:1"s}
+	, {"2001:db8:0:1:1:1:1:1"s,                    "2001:db8:0:1:1:1:1:1"s}
+	, {"fe80::a:0:0:0:b"s,                         "fe80:0:0:a::b"s}
+	, {"::ffff:192.0.2.128"s,                      "::ffff:192.0.2.128"s}
+	, {"64:ff9b::192.0.2.33"s,                     "64:ff9b::c000:221"s}
+	};
+
+    for (const auto& c : cases)
+    {
+      char buf[ip::traits<ipv6::width>::max_text];
+      auto addr = ipv6::to_addr(c.first);
+      BOOST_CHECK_EQUAL(std::string(buf, ip::format(addr, buf)), c.second);
+      BOOST_CHECK(ipv6::to_addr(c.second) == addr);
+    }
+
+    BOOST_CHECK(ipv6::to_addr("2001:db8::1"s) == ipv6::addr_t({{0x20,0x01,0x0d,0xb8,0,0,0,0,0,0,0,0,0,0,0,1}}));
+  }
+
+  BOOST_AUTO_TEST_CASE(test_ipv6_parse_invalid)
+  {
+    for (const auto& bad : {""s, ":"s, ":1::"s, "1::2::3"s, "1:2:3:4:5:6:7"s, "1:2:3:4:5:6:7:8:9"s
+	, "1:2:3:4:5:6:7:8::"s, "12345::"s, "1:"s, "g::"s, "::1.2.3"s, "::256.1.1.1"s})
+    {
+      BOOST_CHECK_THROW(ipv6::to_addr(bad), std::invalid_argument);
+    }
+
+    // the read path skips malformed lines instead of giving up on the feed
+    std::istringstream feed("2001:db8::1\nbogus\n1:2:3:4:5:6:7:8:9\t1\n::1\n1.2.3.4\n"s);
+    auto ip_pool = ip::read<ipv6::width>(feed);
+    BOOST_CHECK(ip_pool == ipv6::pool_t({ipv6::to_addr("2001:db8::1"s), ipv6::to_addr("::1"s)}));
+
+    std::istringstream ipv4_feed("1.2.3.4\nbogus\n1.2.3.256\n5.6.7.8 x\n"s);
+    BOOST_CHECK(ip::read<ipv4::width>(ipv4_feed) == ipv4::pool_t({{1, 2, 3, 4}, {5, 6, 7, 8}}));
+  }
+
+  BOOST_AUTO_TEST_CASE(test_ipv6_sorting)
+  {
+    std::mt19937 gen(26);
+    std::uniform_int_distribution<int> byte_dist(0, 255);
+
+    auto ip_pool = ipv6::pool_t(1000);
+    for (auto& addr : ip_pool)
+    {
+      // shared leading bytes exercise skipped radix passes
+      addr[0] = 0x20;
+      addr[1] = 0x01;
+      for (size_t i = 2; i < addr.size(); ++i)
+	addr[i] = static_cast<ipv6::byte_t>(byte_dist(gen) & (i < 8 ? 0x03 : 0xff));
+    }
+
+    auto correct_pool = ip_pool;
+    std::sort(std::begin(correct_pool), std::end(correct_pool), std::greater<ipv6::addr_t>());
+    ipv6::sort(ip_pool);
+
+    BOOST_CHECK(correct_pool == ip_pool);
+  }
+
+  BOOST_AUTO_TEST_CASE(test_ipv6_filter)
+  {
+    std::mt19937 gen(6);
+    std::uniform_int_distribution<int> byte_dist(0, 3);
+
+    auto ip_pool = ipv6::pool_t(1000);
+    for (auto& addr : ip_pool)
+      for (auto& addr_byte : addr)
+	addr_byte = static_cast<ipv6::byte_t>(byte_dist(gen) == 0 ? 46 : byte_dist(gen) + 70);
+
+    auto correct_pool = ipv6::pool_t();
+    std::copy_if(std::begin(ip_pool), std::end(ip_pool), std::back_inserter(correct_pool)
+	, [](const ipv6::addr_t& addr) {return ipv6::bytesPredicate<0>(addr, 46, 70);});
+
+    BOOST_CHECK(!correct_pool.empty());
+    BOOST_CHECK(correct_pool == ipv6::filter(ip_pool, 46, 70));
+    BOOST_CHECK(ipv6::filter_any_seq(ip_pool, 46) == ipv6::filter_any(ip_pool, 46));
+    BOOST_CHECK(ipv6::filter_any(ip_pool, 300).empty());
+  }
+
+
+
+  BOOST_AUTO_TEST_CASE(test_bloom_filter)
+  {
+    std::ifstream data("test_data.tsv");
+    BOOST_CHECK(data.is_open());
+
+    auto ip_pool = ipv4::pool_t();
+
+    for(std::string line; std::getline(data, line);)
+      ip_pool.emplace_back(ipv4::to_addr(ipv4::split(line, '\t').at(0)));
+
+    const double false_positive_rate = 0.01;
+    auto blocklist = ipv4::bloom_filter(ip_pool, false_positive_rate);
+
+    BOOST_CHECK(std::all_of(std::begin(ip_pool), std::end(ip_pool)
+	  , [&blocklist](const ipv4::addr_t& addr) {return blocklist.contains(addr);}));
+
+    // addresses of 10/8 are not in the test data
+    std::mt19937 gen(27);
+    auto probes = ipv4::pool_t(100000);
+    for (auto& addr : probes)
+      addr = ip::from_key<ipv4::width>((10u << 24) | (gen() & 0xffffff));
+
+    auto found = std::vector<char>(probes.size());
+    blocklist.contains(std::begin(probes), std::end(probes), std::begin(found));
+    auto false_positives = std::count(std::begin(found), std::end(found), 1);
+    BOOST_CHECK(false_positives < static_cast<long>(probes.size() * false_positive_rate * 2));
+
+    for (size_t i = 0; i < probes.size(); ++i)
+      BOOST_CHECK(blocklist.contains(probes[i]) == (found[i] != 0));
+
+    BOOST_CHECK(blocklist.filter(probes).size() == static_cast<size_t>(false_positives));
+  }
+
+  BOOST_AUTO_TEST_CASE(test_bloom_filter_copies)
+  {
+    std::mt19937 gen(29);
+    auto ip_pool = ipv4::pool_t(200);
+    for (auto& addr : ip_pool)
+      addr = ip::from_key<ipv4::width>(static_cast<uint32_t>(gen()));
+    const auto blocklist = ipv4::bloom_filter(ip_pool, 0.01);
+
+    // spacers of every size move the copies across cache line offsets
+    auto copies = std::vector<ipv4::bloom_filter>();
+    auto spacers = std::vector<std::vector<char>>();
+    for (size_t i = 0; i < 64; ++i)
+    {
+      spacers.emplace_back(i * 8 + 1);
+      copies.push_back(blocklist);
+    }
+    auto assigned = ipv4::bloom_filter(1, 0.5);
+    assigned = copies.back();
+    copies.push_back(assigned);
+
+    for (const auto& copy : copies)
+    {
+      BOOST_CHECK(copy.filter(ip_pool) == ip_pool);
+      BOOST_CHECK(copy.hash_count() == blocklist.hash_count());
+      BOOST_CHECK(copy.size_in_bytes() == blocklist.size_in_bytes());
+    }
+  }
+
+  BOOST_AUTO_TEST_CASE(test_bloom_filter_tight_rate)
+  {
+    // members have the top bit clear, probes set
+    std::mt19937 gen(127);
+    auto ip_pool = ipv4::pool_t(1000000);
+    for (auto& addr : ip_pool)
+      addr = ip::from_key<ipv4::width>(static_cast<uint32_t>(gen()) & 0x7fffffffu);
+
+    const double false_positive_rate = 0.001;
+    auto blocklist = ipv4::bloom_filter(ip_pool, false_positive_rate);
+    BOOST_CHECK(std::all_of(std::begin(ip_pool), std::end(ip_pool)
+	  , [&blocklist](const ipv4::addr_t& addr) {return blocklist.contains(addr);}));
+
+    // the sizing aims at the rate itself, not at a safety margin below it
+    const double keys_per_block = static_cast<double>(ip_pool.size()) * ipv4::bloom_filter::block_bits / 8 / static_cast<double>(blocklist.size_in_bytes());
+    const auto predicted = ipv4::bloom_filter::predicted_rate(keys_per_block, blocklist.hash_count());
+    BOOST_CHECK(predicted <= false_positive_rate);
+    BOOST_CHECK(predicted > false_positive_rate * 0.9);
+
+    const size_t probes = 2000000;
+    size_t false_positives = 0;
+    for (size_t i = 0; i < probes; ++i)
+      false_positives += blocklist.contains(ip::from_key<ipv4::width>(static_cast<uint32_t>(gen()) | 0x80000000u));
+    BOOST_CHECK_LT(false_positives, static_cast<size_t>(probes * false_positive_rate * 1.1));
+  }
+
+  BOOST_AUTO_TEST_CASE(test_bloom_filter_save_load)
+  {
+    auto ip_pool = ipv6::pool_t({
+	  ipv6::to_addr("2001:db8::1"s)
+	, ipv6::to_addr("2001:db8::2"s)
+	, ipv6::to_addr("::ffff:46.70.29.76"s)
+	});
+
+    auto blocklist = ipv6::bloom_filter(ip_pool, 0.001);
+
+    std::stringstream stream;
+    blocklist.save(stream);
+    auto loaded = ipv6::bloom_filter::load(stream);
+
+    BOOST_CHECK(loaded.hash_count() == blocklist.hash_count());
+    BOOST_CHECK(loaded.size_in_bytes() == blocklist.size_in_bytes());
+    BOOST_CHECK(loaded.filter(ip_pool) == ip_pool);
+
+    std::stringstream truncated(stream.str().substr(0, 10));
+    BOOST_CHECK_THROW(ipv6::bloom_filter::load(truncated), std::runtime_error);
+    std::stringstream ipv4_stream(stream.str());
+    BOOST_CHECK_THROW(ipv4::bloom_filter::load(ipv4_stream), std::runtime_error);
+  }
+
+  BOOST_AUTO_TEST_CASE(test_loser_tree_merge)
+  {
+    std::ifstream data("test_data.tsv");
+    BOOST_CHECK(data.is_open());
+
+    auto ip_pool = ip::read<ipv4::width>(data);
+    BOOST_CHECK(ip_pool.size() == 1000);
+
+    // uneven runs, including empty ones
+    auto runs = std::vector<ipv4::pool_t>(7);
+    for (size_t i = 0; i < ip_pool.size(); ++i)
+      runs[(i * i) % 5].push_back(ip_pool[i]);
+    for (auto& run : runs)
+      ipv4::sort(run);
+
+    ipv4::sort(ip_pool);
+    BOOST_CHECK(ip::merge(runs) == ip_pool);
+    BOOST_CHECK(ip::merge(std::vector<ipv4::pool_t>(1, ip_pool)) == ip_pool);
+    BOOST_CHECK(ip::merge(std::vector<ipv4::pool_t>()).empty());
+  }
+
+  BOOST_AUTO_TEST_CASE(test_read_sorted_files)
+  {
+    std::ifstream data("test_data.tsv");
+    BOOST_CHECK(data.is_open());
+
+    auto paths = std::vector<std::string>();
+    auto parts = std::vector<std::ofstream>();
+    for (size_t i = 0; i < 3; ++i)
+    {
+      paths.push_back("test_data_part_" + std::to_string(i) + ".tsv");
+      parts.emplace_back(paths.back());
+    }
+    size_t line_number = 0;
+    for(std::string line; std::getline(data, line); ++line_number)
+      parts[line_number % parts.size()] << line << '\n';
+    parts.clear();
+
+    auto expanded = ip::expand_paths({"test_data_part_*.tsv"s});
+    BOOST_CHECK(expanded == paths);
+    BOOST_CHECK_THROW(ip::expand_paths({"test_data_missing_*.tsv"s}), std::runtime_error);
+
+    auto runs = ip::read_sorted<ipv4::width>(expanded, 2);
+    BOOST_CHECK(runs.size() == paths.size());
+    BOOST_CHECK(std::all_of(std::begin(runs), std::end(runs)
+	  , [](const ipv4::pool_t& run) {return std::is_sorted(std::begin(run), std::end(run), std::greater<ipv4::addr_t>());}));
+
+    auto ip_pool = ip::read_file<ipv4::width>("test_data.tsv");
+    ipv4::sort(ip_pool);
+    BOOST_CHECK(ip::merge(runs) == ip_pool);
+
+    BOOST_CHECK_THROW(ip::read_sorted<ipv4::width>({"test_data_missing.tsv"s}), std::runtime_error);
+
+    // every file once, on a worker within the clamped count; the first
+    // failure in path order is the one rethrown
+    BOOST_CHECK(ip::file_workers(3, 8) == 3);
+    BOOST_CHECK(ip::file_workers(0, 8) == 1);
+    BOOST_CHECK(ip::file_workers(3, 0) >= 1);
+    auto visits = std::vector<std::atomic<size_t>>(16);
+    std::atomic<bool> worker_in_range(true);
+    auto many = std::vector<std::string>(visits.size(), "test_data.tsv");
+    ip::for_each_file(many, 4, [&](size_t worker, size_t file)
+	{
+	  worker_in_range = worker_in_range && worker < 4;
+	  ++visits[file];
+	});
+    BOOST_CHECK(worker_in_range);
+    BOOST_CHECK(std::all_of(visits.begin(), visits.end(), [](const std::atomic<size_t>& count) {return count == 1;}));
+    try
+    {
+      ip::for_each_file(many, 4, [](size_t, size_t file)
+	  {
+	    if (file == 3 || file == 9)
+	      throw std::runtime_error("file " + std::to_string(file));
+	  });
+      BOOST_ERROR("for_each_file swallowed the failures");
+    }
+    catch (const std::runtime_error& e)
+    {
+      BOOST_CHECK(e.what() == "file 3"s);
+    }
+
+    // unseekable input, as with "ip_filter <(zcat data.gz)"
+    const auto fifo = "test_data_fifo"s;
+    std::remove(fifo.c_str());
+    BOOST_REQUIRE(::mkfifo(fifo.c_str(), 0600) == 0);
+    std::thread writer([&fifo]()
+	{
+	  std::ifstream source("test_data.tsv");
+	  std::ofstream sink(fifo);
+	  sink << source.rdbuf();
+	});
+    auto piped_pool = ip::read_file<ipv4::width>(fifo);
+    writer.join();
+    std::remove(fifo.c_str());
+    ipv4::sort(piped_pool);
+    BOOST_CHECK(piped_pool == ip_pool);
+
+    for (const auto& path : paths)
+      std::remove(path.c_str());
+  }
+
+  BOOST_AUTO_TEST_CASE(test_output_cidr_and_range)
+  {
+    auto ip_pool = ipv4::pool_t();
+    for (uint32_t key = (10u << 24) + 3; key <= (10u << 24) + 20; ++key)
+      ip_pool.push_back(ip::from_key<ipv4::width>(key));
+    ip_pool.push_back(ipv4::to_addr("10.0.0.7"s));
+    ip_pool.push_back(ipv4::to_addr("1.1.234.8"s));
+    ip_pool.push_back(ipv4::to_addr("0.0.0.0"s));
+    ip_pool.push_back(ipv4::to_addr("255.255.255.255"s));
+    ipv4::sort(ip_pool);
+
+    std::ostringstream cidr;
+    ip::print(cidr, ip_pool, ip::output_format::cidr);
+    BOOST_CHECK_EQUAL(cidr.str()
+	, "255.255.255.255/32\n"
+	  "10.0.0.20/32\n"
+	  "10.0.0.16/30\n"
+	  "10.0.0.8/29\n"
+	  "10.0.0.4/30\n"
+	  "10.0.0.3/32\n"
+	  "1.1.234.8/32\n"
+	  "0.0.0.0/32\n"s);
+
+    std::ostringstream range;
+    ip::print(range, ip_pool, ip::output_format::range);
+    BOOST_CHECK_EQUAL(range.str()
+	, "255.255.255.255-255.255.255.255\n"
+	  "10.0.0.3-10.0.0.20\n"
+	  "1.1.234.8-1.1.234.8\n"
+	  "0.0.0.0-0.0.0.0\n"s);
+
+    auto whole = ipv6::pool_t({ipv6::to_addr("::"s), ipv6::to_addr("::1"s), ipv6::to_addr("::2"s), ipv6::to_addr("::3"s)});
+    ipv6::sort(whole);
+    std::ostringstream cidr6;
+    ip::print(cidr6, whole, ip::output_format::cidr);
+    BOOST_CHECK_EQUAL(cidr6.str(), "::/126\n"s);
+
+    BOOST_CHECK_THROW(ip::to_output_format("json"s), std::invalid_argument);
+  }
+
+  BOOST_AUTO_TEST_CASE(test_output_binary)
+  {
+    auto ip_pool = ip::read_file<ipv4::width>("test_data.tsv");
+    ipv4::sort(ip_pool);
+
+    std::stringstream stream;
+    ip::print(stream, ip_pool, ip::output_format::binary);
+    ip::print(stream, ipv4::filter(ip_pool, 46, 70), ip::output_format::binary);
+    BOOST_CHECK(stream.str().size() == 2 * ip::binary_header_size + (ip_pool.size() + 4) * ipv4::width);
+
+    BOOST_CHECK(ip::read_binary<ipv4::width>(stream) == ip_pool);
+    BOOST_CHECK(ip::read_binary<ipv4::width>(stream) == ipv4::filter(ip_pool, 46, 70));
+
+    std::stringstream truncated(stream.str().substr(0, ip::binary_header_size + 5));
+    BOOST_CHECK_THROW(ip::read_binary<ipv4::width>(truncated), std::runtime_error);
+
+    // version 1 sections, written before chunks, still read
+    auto unchunked = stream.str().substr(0, ip::binary_header_size + ip_pool.size() * ipv4::width);
+    unchunked[4] = 1;
+    std::stringstream version_1(unchunked);
+    BOOST_CHECK(ip::read_binary<ipv4::width>(version_1) == ip_pool);
+
+    // the streaming encoder holds a chunk at most, the reader joins them
+    std::mt19937 gen(29);
+    auto large_pool = ipv6::pool_t(2 * ip::binary_chunk_size + 7);
+    for (auto& addr : large_pool)
+      for (auto& byte : addr)
+	byte = static_cast<ipv6::byte_t>(gen());
+
+    std::stringstream streamed;
+    auto output = ip::encoder<ipv6::width>(streamed, ip::output_format::binary);
+    for (const auto& addr : large_pool)
+      output.push(addr);
+    output.finish();
+    ip::print(streamed, ipv6::pool_t(large_pool.begin(), large_pool.begin() + 3), ip::output_format::binary);
+    BOOST_CHECK(streamed.str().size() == 4 * ip::binary_header_size + (large_pool.size() + 3) * ipv6::width);
+    BOOST_CHECK(ip::read_binary<ipv6::width>(streamed) == large_pool);
+    BOOST_CHECK(ip::read_binary<ipv6::width>(streamed) == ipv6::pool_t(large_pool.begin(), large_pool.begin() + 3));
+  }
+
+  BOOST_AUTO_TEST_CASE(test_kernels_against_scalar)
+  {
+    std::ifstream data("test_data.tsv");
+    BOOST_CHECK(data.is_open());
+
+    std::ostringstream buffer;
+    buffer << data.rdbuf();
+    // lines the vectorized parsers have to hand over to try_parse<4>(), or skip
+    auto text = "1.2.3.4567\t1\n\n  \t10.0.0.1 2\r\n1..2.3\n300.1.2.3\t0\nabc\n1.2.3.4.5\n0.0.0.0\n255.255.255.255\n"s
+      + buffer.str() + "1.2.3.4"s;
+
+    const auto& reference = ip::find_kernels("scalar"s);
+    auto supported = ip::supported_kernels();
+    BOOST_CHECK(supported.front() == &reference);
+
+    // every line holds at most one address, small chunks exercise resuming
+    auto read = [&text](const ip::kernels& k, size_t chunk)
+    {
+      auto ip_pool = ipv4::pool_t(text.size());
+      const char* first = text.data();
+      size_t count = 0;
+      while (first != text.data() + text.size())
+	count += k.read(first, text.data() + text.size(), ip_pool.data() + count, chunk);
+      ip_pool.resize(count);
+      return ip_pool;
+    };
+
+    auto reference_pool = read(reference, text.size());
+    // "1.2.3.4567", "1..2.3", "300.1.2.3", "abc" and "1.2.3.4.5" are skipped
+    BOOST_CHECK(reference_pool.size() == 1004);
+    BOOST_CHECK(reference_pool[0] == ipv4::addr_t({{10, 0, 0, 1}}));
+    BOOST_CHECK(reference_pool[1] == ipv4::addr_t({{0, 0, 0, 0}}));
+
+    auto reference_text = std::string(reference_pool.size() * 16 + 16, '\0');
+    reference_text.resize(reference.format(reference_pool.data(), reference_pool.size(), &reference_text[0]));
+
+    for (auto k : supported)
+    {
+      BOOST_TEST_MESSAGE("kernel " << k->name);
+
+      auto ip_pool = read(*k, text.size());
+      BOOST_CHECK(ip_pool == reference_pool);
+      BOOST_CHECK(read(*k, 7) == reference_pool);
+
+      auto formatted = std::string(ip_pool.size() * 16 + 16, '\0');
+      formatted.resize(k->format(ip_pool.data(), ip_pool.size(), &formatted[0]));
+      BOOST_CHECK(formatted == reference_text);
+
+      auto matches = ipv4::pool_t(ip_pool.size());
+      auto reference_matches = ipv4::pool_t(ip_pool.size());
+      for (int byte = 0; byte < 256; ++byte)
+      {
+	// odd sizes exercise the tails
+	auto n = ip_pool.size() - static_cast<size_t>(byte % 17);
+
+	auto pfx = ip::make_prefix<ipv4::width>(byte, 70);
+	auto count = k->filter_prefix(ip_pool.data(), n, pfx, matches.data());
+	BOOST_CHECK(count == reference.filter_prefix(ip_pool.data(), n, pfx, reference_matches.data()));
+	BOOST_CHECK(std::equal(matches.data(), matches.data() + count, reference_matches.data()));
+
+	count = k->filter_any(ip_pool.data(), n, static_cast<ipv4::byte_t>(byte), matches.data());
+	BOOST_CHECK(count == reference.filter_any(ip_pool.data(), n, static_cast<ipv4::byte_t>(byte), reference_matches.data()));
+	BOOST_CHECK(std::equal(matches.data(), matches.data() + count, reference_matches.data()));
+      }
+    }
+
+    BOOST_CHECK_THROW(ip::find_kernels("neon"s), std::invalid_argument);
+  }
+
+  BOOST_AUTO_TEST_CASE(test_expression_against_predicates)
+  {
+    auto ip_pool = ip::read_file<ipv4::width>("test_data.tsv");
+    ipv4::sort(ip_pool);
+
+    auto has = [](const ipv4::addr_t& addr, int byte) {return std::find(addr.cbegin(), addr.cend(), byte) != addr.cend();};
+    auto key = [](const ipv4::addr_t& addr) {return ip::to_key(addr);};
+
+    const std::vector<std::pair<std::string, std::function<bool(const ipv4::addr_t&)>>> cases = {
+	  {"all"s,                        [](const ipv4::addr_t&) {return true;}}
+	, {"o1=1"s,                       [](const ipv4::addr_t& a) {return a[0] == 1;}}
+	, {"o1=46 and o2=70"s,            [](const ipv4::addr_t& a) {return a[0] == 46 && a[1] == 70;}}
+	, {"any=46"s,                     [&](const ipv4::addr_t& a) {return has(a, 46);}}
+	, {"o1=46 && any=70 && !46.70.0.0/16"s, [&](const ipv4::addr_t& a) {return a[0] == 46 && has(a, 70) && a[1] != 70;}}
+	, {"not (o1=46 or o4!=70)"s,      [](const ipv4::addr_t& a) {return a[0] != 46 && a[3] == 70;}}
+	, {"185.46.84.0/22 | 1.0.0.0/8"s, [](const ipv4::addr_t& a) {return (a[0] == 185 && a[1] == 46 && (a[2] & 0xfc) == 84) || a[0] == 1;}}
+	, {"1.70.0.0-1.87.255.255 and not any=44"s, [&](const ipv4::addr_t& a) {return key(a) >= 0x01460000u && key(a) <= 0x0157ffffu && !has(a, 44);}}
+	, {"46.0.0.0-47.0.0.0 & 0.0.0.0-46.100.0.0 & o2=70"s, [](const ipv4::addr_t& a) {return a[0] == 46 && a[1] == 70;}}
+	, {"o1=46 and o1=47"s,            [](const ipv4::addr_t&) {return false;}}
+	, {"0.0.0.0/0 and not (all)"s,    [](const ipv4::addr_t&) {return false;}}
+	, {"222.173.235.246"s,            [](const ipv4::addr_t& a) {return a == ipv4::addr_t({{222,173,235,246}});}}
+	  // deep enough for the evaluator to split its blocks
+	, {"o1=1 or (any=2 and (o1=3 or (any=4 and (o1=5 or (any=6 and (o1=7 or (any=8 and (o1=9 or (any=10 and (o1=11 or any=12))))))))))"s
+	    , [&](const ipv4::addr_t& a)
+	      {
+		bool result = has(a, 12);
+		for (int byte = 11; byte > 0; byte -= 2)
+		  result = (a[0] == byte) || (has(a, byte + 1) && result);
+		return result;
+	      }}
+	};
+
+    for (const auto& c : cases)
+    {
+      BOOST_TEST_MESSAGE("expression " << c.first);
+      auto correct_pool = ipv4::pool_t();
+      std::copy_if(std::begin(ip_pool), std::end(ip_pool), std::back_inserter(correct_pool), c.second);
+
+      auto query = ipv4::expression(c.first);
+      BOOST_CHECK(query.filter(ip_pool) == correct_pool);
+      BOOST_CHECK(std::all_of(std::begin(ip_pool), std::end(ip_pool)
+	    , [&](const ipv4::addr_t& addr) {return query.match(addr) == c.second(addr);}));
+    }
+
+    BOOST_CHECK(ipv4::expression("o1=46 and o2=70"s).filter(ip_pool) == ipv4::filter(ip_pool, 46, 70));
+    BOOST_CHECK(ipv4::expression("any=46"s).filter(ip_pool) == ipv4::filter_any(ip_pool, 46));
+  }
+
+  BOOST_AUTO_TEST_CASE(test_expression_compilation)
+  {
+    // octets, addresses and CIDR blocks of a conjunction become one mask/compare
+    BOOST_CHECK(ipv4::expression("o1=46 and o2=70 and 46.70.0.0/16"s).size() == 1);
+    BOOST_CHECK(ipv4::expression("not (o1!=46 or o2!=70)"s).size() == 1);
+    BOOST_CHECK(ipv4::expression("1.0.0.0-2.0.0.0 and 1.5.0.0-3.0.0.0"s).size() == 1);
+    BOOST_CHECK(ipv4::expression("o1=46 and o1=47"s).size() == 1);
+    BOOST_CHECK(ipv4::expression("o1=46 and any=70 and not 46.70.0.0/16"s).size() == 5); // three tests, two binary ands
+
+    for (const auto& bad : {""s, "o1="s, "o0=1"s, "o5=1"s, "o1=256"s, "any"s, "46.70"s, "(all"s, "all)"s
+	, "1.2.3.4/33"s, "2.0.0.0-1.0.0.0"s, "o1=46 and"s, "foo"s, "o1=46 ^ o2=1"s, "::1"s})
+    {
+      BOOST_CHECK_THROW(ipv4::expression{bad}, std::invalid_argument);
+    }
+
+    auto ip_pool = ipv6::pool_t({
+	  ipv6::to_addr("2001:db8::1"s)
+	, ipv6::to_addr("2001:db8:1::46"s)
+	, ipv6::to_addr("fe80::1"s)
+	});
+    BOOST_CHECK(ipv6::expression("2001:db8::/32 and not any=70"s).filter(ip_pool) == ipv6::pool_t(ip_pool.begin(), ip_pool.begin() + 1)); // 0x46 is 70
+    BOOST_CHECK(ipv6::expression("o16=70 or o1=254"s).filter(ip_pool) == ipv6::pool_t(ip_pool.begin() + 1, ip_pool.end()));
+    BOOST_CHECK(ipv6::expression("2001:db8::-2001:db8::ffff"s).filter(ip_pool) == ipv6::pool_t(ip_pool.begin(), ip_pool.begin() + 1));
+  }
+
+  BOOST_AUTO_TEST_CASE(test_expression_limits)
+  {
+    auto ip_pool = ip::read_file<ipv4::width>("test_data.tsv");
+
+    // a flat disjunction keeps two slots of the evaluation stack however long
+    auto terms = std::string("1.1.1.1");
+    for (size_t i = 0; i < 9000; ++i)
+      terms += " or 10." + std::to_string(i / 256) + "." + std::to_string(i % 256) + ".1";
+    terms += " or o1=46";
+    BOOST_CHECK(ipv4::expression(terms).filter(ip_pool) == ipv4::filter(ip_pool, 46));
+
+    // nesting within the limit evaluates, beyond it throws instead of
+    // overflowing the call stack
+    auto nested = [](size_t levels, const std::string& open, const std::string& close)
+    {
+      auto text = std::string();
+      for (size_t i = 0; i < levels; ++i)
+	text += open;
+      text += "o1=46";
+      for (size_t i = 0; i < levels; ++i)
+	text += close;
+      return text;
+    };
+    BOOST_CHECK(ipv4::expression(nested(256, "(o2=70 or ", ")")).filter(ip_pool)
+	== ipv4::expression("o2=70 or o1=46"s).filter(ip_pool));
+    BOOST_CHECK(ipv4::expression(nested(256, "not ", "")).filter(ip_pool) == ipv4::filter(ip_pool, 46));
+    // three levels a step, an odd number of steps leaves the negation
+    BOOST_CHECK(ipv4::expression(nested(85, "(any=1 and not (", "))")).count(ip_pool)
+	== ipv4::expression("any=1 and not o1=46"s).count(ip_pool));
+
+    BOOST_CHECK_THROW(ipv4::expression(nested(257, "(", ")")), std::invalid_argument);
+    BOOST_CHECK_THROW(ipv4::expression(nested(10000, "(", ")")), std::invalid_argument);
+    BOOST_CHECK_THROW(ipv4::expression(nested(30000, "not ", "")), std::invalid_argument);
+  }
+
+  BOOST_AUTO_TEST_CASE(test_hyperloglog_estimate)
+  {
+    auto half = ip::hyperloglog(14);
+    auto whole = ip::hyperloglog(14);
+    for (uint64_t i = 0; i < 100000; ++i)
+    {
+      whole.add(ip::hash_key(i));
+      if (i % 2 == 0)
+	half.add(ip::hash_key(i));
+    }
+    BOOST_CHECK(std::abs(whole.estimate() - 100000.0) < 100000.0 * 0.03);
+    BOOST_CHECK(std::abs(half.estimate() - 50000.0) < 50000.0 * 0.03);
+
+    auto other = ip::hyperloglog(14);
+    for (uint64_t i = 1; i < 100000; i += 2)
+      other.add(ip::hash_key(i));
+    half.merge(other);
+    BOOST_CHECK(half.estimate() == whole.estimate());
+
+    auto small = ip::hyperloglog(10);
+    for (uint64_t i = 0; i < 100; ++i)
+      small.add(ip::hash_key(i));
+    BOOST_CHECK(std::abs(small.estimate() - 100.0) < 5.0);
+
+    BOOST_CHECK_THROW(half.merge(small), std::invalid_argument);
+    BOOST_CHECK_THROW(ip::hyperloglog(2), std::invalid_argument);
+  }
+
+  BOOST_AUTO_TEST_CASE(test_traffic_sketch_against_exact_counts)
+  {
+    auto exact = std::map<ipv4::addr_t, uint64_t>();
+    auto lines = std::vector<std::string>();
+    std::ifstream data("test_data.tsv");
+    for(std::string line; std::getline(data, line);)
+    {
+      auto v = ipv4::split(line, '\t');
+      exact[ipv4::to_addr(v.at(0))] += std::stoull(v.at(1));
+      lines.push_back(line);
+    }
+    uint64_t total = 0;
+    for (const auto& entry : exact)
+      total += entry.second;
+
+    auto opts = ipv4::traffic_sketch::default_options();
+    opts.top_capacity = 64;
+    opts.prefix_length = 8;
+
+    // whole stream, and two halves merged
+    auto whole = ipv4::traffic_sketch(opts);
+    auto halves = std::vector<ipv4::traffic_sketch>(2, ipv4::traffic_sketch(opts));
+    std::stringstream whole_stream, half_streams[2];
+    for (size_t i = 0; i < lines.size(); ++i)
+    {
+      whole_stream << lines[i] << '\n';
+      half_streams[i < lines.size() / 2] << lines[i] << '\n';
+    }
+    ip::sketch_stream(whole_stream, whole);
+    ip::sketch_stream(half_streams[0], halves[0]);
+    ip::sketch_stream(half_streams[1], halves[1]);
+    halves[0].merge(halves[1]);
+
+    for (const auto& sketch : {whole, halves[0]})
+    {
+      auto talkers = sketch.top(opts.top_capacity);
+      BOOST_CHECK(talkers.size() == opts.top_capacity);
+      for (const auto& c : talkers)
+      {
+	BOOST_CHECK(c.count - c.error <= exact[c.addr]);
+	BOOST_CHECK(exact[c.addr] <= c.count);
+      }
+      // every address above total / capacity is guaranteed to be reported
+      for (const auto& entry : exact)
+      {
+	if (entry.second * opts.top_capacity <= total)
+	  continue;
+	BOOST_CHECK(std::any_of(std::begin(talkers), std::end(talkers)
+	      , [&](const ipv4::traffic_sketch::counter& c) {return c.addr == entry.first;}));
+      }
+
+      BOOST_CHECK(std::abs(sketch.distinct() - static_cast<double>(exact.size())) < exact.size() * 0.05);
+      BOOST_CHECK(sketch.distinct_per_prefix().size() <= 256);
+    }
+    BOOST_CHECK(halves[0].distinct() == whole.distinct());
+    BOOST_CHECK(halves[0].distinct_per_prefix() == whole.distinct_per_prefix());
+
+    auto exact_per_prefix = std::map<ipv4::byte_t, double>();
+    for (const auto& entry : exact)
+      exact_per_prefix[entry.first[0]] += 1.0;
+    for (const auto& entry : whole.distinct_per_prefix())
+    {
+      BOOST_CHECK(entry.first[1] == 0);
+      BOOST_CHECK(std::abs(entry.second - exact_per_prefix[entry.first[0]]) < 2.0);
+    }
+
+    // weights that are not numbers or do not fit count as 1
+    auto weighted = ipv4::traffic_sketch(opts);
+    std::istringstream weighted_stream("1.1.1.1\t5\n1.1.1.1\tx\n1.1.1.1\t99999999999999999999\n1.1.1.1\t5x\n1.1.1.1\n"s);
+    ip::sketch_stream(weighted_stream, weighted);
+    BOOST_CHECK_EQUAL(weighted.top(1).front().count, 9u);
+
+    BOOST_CHECK_THROW(ipv4::traffic_sketch({64, 33, 14, 10, 64}), std::invalid_argument);
+    BOOST_CHECK_THROW(whole.merge(ipv4::traffic_sketch()), std::invalid_argument);
+  }
+
+  BOOST_AUTO_TEST_CASE(test_traffic_sketch_files)
+  {
+    std::ifstream data("test_data.tsv");
+    BOOST_CHECK(data.is_open());
+
+    auto paths = std::vector<std::string>();
+    auto parts = std::vector<std::ofstream>();
+    for (size_t i = 0; i < 3; ++i)
+    {
+      paths.push_back("test_sketch_part_" + std::to_string(i) + ".tsv");
+      parts.emplace_back(paths.back());
+    }
+    std::stringstream whole_stream;
+    size_t line_number = 0;
+    for(std::string line; std::getline(data, line); ++line_number)
+    {
+      parts[line_number % parts.size()] << line << '\n';
+      whole_stream << line << '\n';
+    }
+    parts.clear();
+
+    // few prefix counters: the busiest /16 prefixes keep theirs
+    auto opts = ipv4::traffic_sketch::default_options();
+    opts.top_capacity = 64;
+    opts.prefix_capacity = 8;
+
+    auto whole = ipv4::traffic_sketch(opts);
+    ip::sketch_stream(whole_stream, whole);
+    auto merged = ip::sketch_files<ipv4::width>(paths, opts, 2, 3);
+
+    BOOST_CHECK(merged.distinct() == whole.distinct());
+    BOOST_CHECK(merged.distinct_per_prefix().size() <= opts.prefix_capacity);
+    BOOST_CHECK(whole.distinct_per_prefix().size() <= opts.prefix_capacity);
+    BOOST_CHECK(!merged.distinct_per_prefix().empty());
+
+    auto exact = std::map<ipv4::addr_t, uint64_t>();
+    std::ifstream again("test_data.tsv");
+    for(std::string line; std::getline(again, line);)
+    {
+      auto v = ipv4::split(line, '\t');
+      exact[ipv4::to_addr(v.at(0))] += std::stoull(v.at(1));
+    }
+    for (const auto& c : merged.top(opts.top_capacity))
+    {
+      BOOST_CHECK(c.count - c.error <= exact[c.addr]);
+      BOOST_CHECK(exact[c.addr] <= c.count);
+    }
+
+    // a prefix counter never counts more than the addresses of its prefix
+    for (const auto& entry : merged.distinct_per_prefix())
+    {
+      auto in_prefix = std::count_if(std::begin(exact), std::end(exact)
+	  , [&](const std::pair<const ipv4::addr_t, uint64_t>& e) {return e.first[0] == entry.first[0] && e.first[1] == entry.first[1];});
+      BOOST_CHECK(entry.second < static_cast<double>(in_prefix) + 1.0);
+    }
+
+    BOOST_CHECK_THROW(ip::sketch_files<ipv4::width>({"test_sketch_missing.tsv"s}, opts), std::runtime_error);
+
+    for (const auto& path : paths)
+      std::remove(path.c_str());
+  }
+
+  BOOST_AUTO_TEST_CASE(test_snapshot_lookup)
+  {
+    auto ip_pool = ip::read_file<ipv4::width>("test_data.tsv");
+    auto indexed = ipv4::snapshot(ip_pool, 7);
+    ipv4::sort(ip_pool);
+    BOOST_CHECK(indexed.pool() == ip_pool);
+    BOOST_CHECK(indexed.generation() == 7);
+
+    BOOST_CHECK(std::all_of(std::begin(ip_pool), std::end(ip_pool), [&](const ipv4::addr_t& addr) {return indexed.contains(addr);}));
+    BOOST_CHECK(!indexed.contains(ipv4::to_addr("0.0.0.1"s)));
+    BOOST_CHECK(!indexed.contains(ipv4::to_addr("46.70.0.1"s)));
+
+    BOOST_CHECK(indexed.filter_prefix(ip::make_prefix<ipv4::width>()) == ip_pool);
+    BOOST_CHECK(indexed.filter_prefix(ip::make_prefix<ipv4::width>(1)) == ipv4::filter(ip_pool, 1));
+    BOOST_CHECK(indexed.filter_prefix(ip::make_prefix<ipv4::width>(46, 70)) == ipv4::filter(ip_pool, 46, 70));
+    BOOST_CHECK(indexed.filter_prefix(ip::make_prefix<ipv4::width>(46, 700)).empty());
+
+    auto sparse = ip::make_prefix<ipv4::width>(46, 70);
+    sparse.mask[0] = 0;
+    BOOST_CHECK_THROW(indexed.equal_range(sparse), std::invalid_argument);
+  }
+
+  BOOST_AUTO_TEST_CASE(test_snapshot_holder_reload)
+  {
+    // generation g holds g addresses
+    auto make_pool = [](uint64_t g)
+    {
+      auto ip_pool = ipv4::pool_t();
+      for (uint32_t i = 0; i < g; ++i)
+	ip_pool.push_back(ip::from_key<ipv4::width>(i * 2654435761u));
+      return ip_pool;
+    };
+
+    ipv4::snapshot_holder holder(ipv4::pool_t(), 8);
+    std::atomic<bool> done(false);
+    std::atomic<size_t> failures(0);
+    auto readers = std::vector<std::thread>();
+    for (size_t i = 0; i < 4; ++i)
+    {
+      readers.emplace_back([&]()
+	  {
+	    uint64_t last = 0;
+	    while (!done)
+	    {
+	      auto pinned = holder.pin();
+	      if (pinned->pool().size() != pinned->generation() || pinned->generation() < last)
+		++failures;
+	      last = pinned->generation();
+	    }
+	  });
+    }
+    for (uint64_t g = 1; g <= 200; ++g)
+      BOOST_CHECK(holder.publish(make_pool(g)) == g);
+    done = true;
+    for (auto& reader : readers)
+      reader.join();
+    BOOST_CHECK(failures == 0);
+    BOOST_CHECK(holder.reclaim() == 0);
+
+    // a pinned snapshot survives its replacement until released
+    {
+      auto pinned = holder.pin();
+      BOOST_CHECK(holder.publish(make_pool(201)) == 201);
+      BOOST_CHECK(holder.reclaim() == 1);
+      BOOST_CHECK(pinned->pool() == ipv4::snapshot(make_pool(200), 200).pool());
+      BOOST_CHECK(holder.pin()->generation() == 201);
+    }
+    BOOST_CHECK(holder.reclaim() == 0);
+
+    // nested pins take a slot each, the one too many fails at once
+    {
+      ipv4::snapshot_holder small(make_pool(3), 2);
+      auto outer = small.pin();
+      {
+	auto inner = small.pin();
+	BOOST_CHECK_THROW(small.pin(), std::runtime_error);
+      }
+      BOOST_CHECK(small.pin()->generation() == 0);
+      BOOST_CHECK(outer->pool().size() == 3);
+    }
+
+    auto reloaded = holder.reload({"test_data.tsv"s});
+    BOOST_CHECK(reloaded.get() == 202);
+    auto ip_pool = ip::read_file<ipv4::width>("test_data.tsv");
+    ipv4::sort(ip_pool);
+    BOOST_CHECK(holder.pin()->pool() == ip_pool);
+  }
+
+  BOOST_AUTO_TEST_CASE(test_range_table_join)
+  {
+    std::istringstream text(
+	"# owner ranges\n"
+	"46.70.0.0-46.70.255.255\tarmenia\n"
+	"1.0.0.0/8\tapnic\n"
+	"222.0.0.0 - 223.255.255.255\tapnic\n"
+	"185.46.87.231\tsingle\n"
+	"5.0.0.0-5.0.0.255\n"
+	);
+    auto table = ipv4::range_table(text);
+    BOOST_CHECK(table.size() == 5);
+
+    auto ip_pool = ip::read_file<ipv4::width>("test_data.tsv");
+    ip_pool.push_back(ipv4::to_addr("5.0.0.1"s));
+    ip_pool.push_back(ipv4::to_addr("46.71.0.0"s));
+    auto reference = [&](const ipv4::addr_t& addr) -> std::string
+    {
+      if (addr[0] == 46 && addr[1] == 70)
+	return "armenia";
+      if (addr[0] == 1 || addr[0] == 222 || addr[0] == 223)
+	return "apnic";
+      if (addr == ipv4::to_addr("185.46.87.231"s))
+	return "single";
+      return (addr == ipv4::to_addr("5.0.0.1"s)) ? "" : "-";
+    };
+    auto check = [&](const ipv4::pool_t& pool, const std::vector<const std::string*>& labels)
+    {
+      BOOST_REQUIRE(labels.size() == pool.size());
+      for (size_t i = 0; i < pool.size(); ++i)
+	BOOST_CHECK((labels[i] ? *labels[i] : "-"s) == reference(pool[i]));
+    };
+
+    // batched Eytzinger lookups, then the merge join over the sorted pool
+    check(ip_pool, table.join(ip_pool));
+    for (size_t i = 0; i < ip_pool.size(); ++i)
+      BOOST_CHECK(table.lookup(ip_pool[i]) == table.join(ip_pool)[i]);
+    ipv4::sort(ip_pool);
+    check(ip_pool, table.join(ip_pool));
+
+    // an out of order address does not derail the cursor
+    auto cursor = ipv4::range_table::cursor(table);
+    BOOST_CHECK(*cursor.next(ipv4::to_addr("46.70.1.1"s)) == "armenia");
+    BOOST_CHECK(*cursor.next(ipv4::to_addr("222.1.1.1"s)) == "apnic");
+    BOOST_CHECK(*cursor.next(ipv4::to_addr("1.1.1.1"s)) == "apnic");
+    BOOST_CHECK(cursor.next(ipv4::to_addr("0.1.1.1"s)) == nullptr);
+
+    std::ostringstream out;
+    ip::print(out, ipv4::pool_t{ipv4::to_addr("1.2.3.4"s), ipv4::to_addr("9.9.9.9"s)}, {table.lookup(ipv4::to_addr("1.2.3.4"s)), nullptr});
+    BOOST_CHECK(out.str() == "1.2.3.4\tapnic\n9.9.9.9\t\n");
+
+    // every table size hits a different shape of the implicit tree
+    std::mt19937 gen(7);
+    for (size_t n : {1, 2, 3, 7, 100, 1000})
+    {
+      std::ostringstream ranges;
+      for (size_t i = 0; i < n; ++i)
+	ranges << i % 256 << '.' << i / 256 << ".0.0/16\t" << i << '\n';
+      std::istringstream stream(ranges.str());
+      auto numbered = ipv4::range_table(stream);
+
+      auto addresses = ipv4::pool_t(5000);
+      for (auto& addr : addresses)
+	addr = ip::from_key<ipv4::width>(static_cast<uint32_t>(gen()) & 0xff03ffff);
+      auto labels = numbered.join(addresses);
+      for (size_t i = 0; i < addresses.size(); ++i)
+      {
+	const auto& addr = addresses[i];
+	const auto expected = static_cast<size_t>(addr[1]) * 256 + addr[0];
+	BOOST_CHECK(expected < n ? (labels[i] && *labels[i] == std::to_string(expected)) : labels[i] == nullptr);
+      }
+    }
+
+    std::istringstream empty("");
+    BOOST_CHECK(ipv4::range_table(empty).lookup(ipv4::to_addr("1.2.3.4"s)) == nullptr);
+
+    // overlaps, empty ranges and malformed addresses or lengths
+    for (const auto& bad : {"1.0.0.0/8\ta\n1.2.0.0/16\tb\n"s, "2.0.0.0-1.0.0.0\ta\n"s, "1.0.0.0/40\ta\n"s
+	, "garbage\tx\n"s, "300.1.1.1-300.1.1.2\tx\n"s, "1.2.3\tx\n"s, "1.0.0.0/8x\tx\n"s, "1.0.0.0/\tx\n"s, "1.0.0.0-\tx\n"s})
+    {
+      std::istringstream stream(bad);
+      BOOST_CHECK_THROW(ipv4::range_table{stream}, std::invalid_argument);
+    }
+  }
+
+  BOOST_AUTO_TEST_CASE(test_arena_pipeline)
+  {
+    std::ifstream data("test_data.tsv");
+    std::ostringstream buffer;
+    buffer << data.rdbuf();
+    const auto text = buffer.str();
+
+    auto run = [&text](auto& ip_pool)
+    {
+      ip::read<ipv4::width>(text.data(), text.data() + text.size(), ip_pool);
+      ipv4::sort(ip_pool);
+      std::ostringstream out;
+      ipv4::print(out, ip_pool);
+      ipv4::print(out, ipv4::filter(ip_pool, 46, 70));
+      ipv4::print(out, ipv4::filter_any(ip_pool, 46));
+      return out.str();
+    };
+    auto heap_pool = ipv4::pool_t();
+    const auto reference = run(heap_pool);
+
+    ip::arena memory(4096);
+    size_t warm_allocations = 0;
+    for (size_t round = 0; round < 4; ++round)
+    {
+      memory.reset();
+      auto ip_pool = ipv4::arena_pool(ip::arena_allocator<ipv4::addr_t>(memory));
+      BOOST_CHECK(run(ip_pool) == reference);
+
+      // results share the allocator of their input
+      auto filtered_pool = ipv4::filter(ip_pool, 1);
+      BOOST_CHECK(filtered_pool.get_allocator() == ip_pool.get_allocator());
+      BOOST_CHECK(std::equal(filtered_pool.begin(), filtered_pool.end(), ipv4::filter(heap_pool, 1).begin()));
+      auto matched_pool = ipv4::expression("o1=46 and o2=70"s).filter(ip_pool);
+      BOOST_CHECK(matched_pool.get_allocator() == ip_pool.get_allocator());
+      BOOST_CHECK(std::equal(matched_pool.begin(), matched_pool.end(), ipv4::filter(heap_pool, 46, 70).begin()));
+
+      // the chunks are merged by the first reset, nothing is allocated after it
+      if (round == 1)
+	warm_allocations = memory.chunk_allocations();
+    }
+    BOOST_CHECK(memory.chunk_allocations() == warm_allocations);
+    BOOST_CHECK(memory.capacity() >= text.size() / 4);
+
+    // reused output pools keep their capacity
+    auto filtered_pool = ipv4::pool_t();
+    ip::filter_any(heap_pool, 46, filtered_pool);
+    auto capacity = filtered_pool.capacity();
+    filtered_pool.clear();
+    ip::filter_any(heap_pool, 46, filtered_pool);
+    BOOST_CHECK(filtered_pool == ipv4::filter_any(heap_pool, 46));
+    BOOST_CHECK(filtered_pool.capacity() == capacity);
+
+    auto v6_pool = ipv6::arena_pool({ipv6::to_addr("2001:db8::46"s), ipv6::to_addr("::1"s)}, ip::arena_allocator<ipv6::addr_t>(memory));
+    BOOST_CHECK(ipv6::filter_any(v6_pool, 0x46).size() == 1);
+
+    auto fields = std::vector<std::string>();
+    const auto line = "1.2..3"s;
+    ip::split(line.data(), line.data() + line.size(), '.', [&fields](const char* first, const char* last) {fields.emplace_back(first, last);});
+    BOOST_CHECK(fields == ipv4::split(line, '.'));
+  }
+
+  BOOST_AUTO_TEST_CASE(test_histogram_counts)
+  {
+    auto ip_pool = ip::read_file<ipv4::width>("test_data.tsv");
+    ip_pool.push_back(ipv4::to_addr("46.46.46.46"s));
+    ip_pool.push_back(ipv4::to_addr("46.70.46.1"s));
+
+    // two halves merged give the same histogram as the whole pool
+    auto counts = ipv4::histogram(ipv4::pool_t(ip_pool.begin(), ip_pool.begin() + 500));
+    counts.merge(ipv4::histogram(ipv4::pool_t(ip_pool.begin() + 500, ip_pool.end())));
+    BOOST_CHECK(counts.size() == ip_pool.size());
+
+    for (int byte = 0; byte < 256; ++byte)
+    {
+      BOOST_CHECK(counts.count(byte) == ipv4::filter(ip_pool, byte).size());
+      BOOST_CHECK(counts.count(byte, 70) == ipv4::filter(ip_pool, byte, 70).size());
+      BOOST_CHECK(counts.count_any(byte) == ipv4::filter_any(ip_pool, byte).size());
+      BOOST_CHECK(counts.count_octet(2, byte) == ipv4::expression("o3=" + std::to_string(byte)).count(ip_pool));
+      BOOST_CHECK(ip::count(ip_pool, byte, 70, 46) == ipv4::filter(ip_pool, byte, 70, 46).size());
+      BOOST_CHECK(ip::count_any(ip_pool, byte) == ipv4::filter_any(ip_pool, byte).size());
+    }
+    BOOST_CHECK(counts.count() == ip_pool.size());
+    BOOST_CHECK(counts.count(46, 700) == 0);
+    BOOST_CHECK(counts.count_any(-1) == 0);
+
+    // CIDR blocks up to /16 from the prefix sums
+    for (unsigned length = 0; length <= 16; ++length)
+    {
+      auto query = ipv4::expression("46.70.0.0/" + std::to_string(length));
+      ip::key_t<ipv4::width> mask, value;
+      size_t result = 0;
+      BOOST_CHECK(query.as_mask(mask, value));
+      BOOST_CHECK(counts.try_count(mask, value, result));
+      BOOST_CHECK(result == query.count(ip_pool));
+      BOOST_CHECK(counts.count_prefix(value, length) == result);
+    }
+    BOOST_CHECK_THROW(counts.count_prefix(0, 17), std::invalid_argument);
+
+    ip::key_t<ipv4::width> mask, value;
+    size_t result = 0;
+    BOOST_CHECK(ipv4::expression("all"s).as_mask(mask, value) && counts.try_count(mask, value, result) && result == ip_pool.size());
+    BOOST_CHECK(ipv4::expression("o1=46 and o3=46"s).as_mask(mask, value) && !counts.try_count(mask, value, result));
+    BOOST_CHECK(!ipv4::expression("not o1=46"s).as_mask(mask, value));
+
+    ipv4::byte_t byte = 0;
+    BOOST_CHECK(ipv4::expression("any=46"s).as_any(byte) && byte == 46);
+    BOOST_CHECK(!ipv4::expression("o1=46 or any=46"s).as_any(byte));
+
+    auto v6_pool = ipv6::pool_t({ipv6::to_addr("2001:db8::46"s), ipv6::to_addr("2001:db9::1"s), ipv6::to_addr("fe80::1"s)});
+    auto v6_counts = ipv6::histogram(v6_pool);
+    BOOST_CHECK(v6_counts.count(0x20, 0x01) == 2);
+    BOOST_CHECK(v6_counts.count_prefix(ip::to_key(ipv6::to_addr("2000::"s)), 3) == 2);
+    BOOST_CHECK(v6_counts.count_any(0) == 3);
+    BOOST_CHECK(v6_counts.count_any(0x46) == 1);
+
+    // per worker histograms over unsorted runs add up to the whole
+    auto runs = std::vector<ipv4::pool_t>();
+    auto file_counts = ip::histogram_files<ipv4::width>({"test_data.tsv", "test_data.tsv", "test_data.tsv"}, runs, 2);
+    auto file_pool = ip::read_file<ipv4::width>("test_data.tsv");
+    BOOST_CHECK(runs.size() == 3);
+    BOOST_CHECK(runs.back() == file_pool);
+    BOOST_CHECK(file_counts.size() == 3 * file_pool.size());
+    BOOST_CHECK(file_counts.count(46, 70) == 3 * ipv4::filter(file_pool, 46, 70).size());
+    BOOST_CHECK(file_counts.count_any(46) == 3 * ipv4::filter_any(file_pool, 46).size());
+    BOOST_CHECK_THROW(ip::histogram_files<ipv4::width>({"no_such_file.tsv"}, runs), std::runtime_error);
+  }
 
 #ifdef IP_FILTER_BENCH
 
@@ -0,0 +1,13 @@
+#pragma once
+
+// internal helpers of the line parsers, not part of the interface
+
+namespace ip
+{
+
+  //! field separators of the input lines
+  inline bool is_space(char sym)
+  {
+    return (sym == ' ' || sym == '\t' || sym == '\r' || sym == '\n');
+  }
+}